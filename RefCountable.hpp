@@ -1,35 +1,489 @@
+#pragma once
+
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <memory>
 #include <stdexcept>
 #include <cassert>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <typeinfo>
 #include <utility>
 
+#if defined(REFCOUNTABLE_STATS)
+#include "RefCountableStats.hpp"
+#endif
+
+#if defined(REFCOUNTABLE_USDT)
+#include "RefCountableProbes.hpp"
+#endif
+
+#if defined(REFCOUNTABLE_TRACE)
+#include "RefCountableTrace.hpp"
+#endif
+
+#if defined(REFCOUNTABLE_CONTENTION)
+#include "RefCountableContention.hpp"
+#endif
+
+#if defined(REFCOUNTABLE_RECORD)
+#include "RefCountableRecorder.hpp"
+#endif
+
+#if defined(REFCOUNTABLE_HOT_OBJECTS)
+#include "RefCountableHotObjects.hpp"
+#endif
+
+#if defined(REFCOUNTABLE_DRAIN)
+#include "RefCountableDrain.hpp"
+#endif
+
+#if defined(REFCOUNTABLE_RUNTIME_CHECKS)
+#include "RefCountableChecks.hpp"
+#endif
+
+#if defined(REFCOUNTABLE_SAMPLED_COUNTING)
+#include "RefCountableSampling.hpp"
+#endif
+
+#if defined(REFCOUNTABLE_SHADOW_UNCHECKED) && !defined(REFCOUNTABLE_SHADOW_COUNTERS)
+#error "REFCOUNTABLE_SHADOW_UNCHECKED requires REFCOUNTABLE_SHADOW_COUNTERS"
+#endif
+
+// With REFCOUNTABLE_SHADOW_COUNTERS, RefCountable<T> keeps its counter in
+// a side table and has the layout of T, so translation units built with
+// REFCOUNTABLE_SHADOW_UNCHECKED can be linked with checked ones. Inline
+// functions that behave differently in unchecked units get an ABI tag so
+// the linker cannot merge them with their checked versions.
+//
+// The tag only covers this library's own functions. The inline
+// constructors and destructors of a user type that embeds a RefCountable,
+// and any other inline function that creates one or a handle to one, are
+// not tagged. If such a type is compiled in both modes, the linker keeps
+// one copy and link order decides which mode it runs in. Every type or
+// inline function like that must be compiled in one mode only, so keep
+// it out of headers shared between checked and unchecked components.
+#if defined(REFCOUNTABLE_SHADOW_COUNTERS)
+#include "RefCountableShadow.hpp"
+#define REFCOUNTABLE_COUNTER_INIT
+#else
+#define REFCOUNTABLE_COUNTER_INIT , counter{0}
+#endif
+
+#if defined(REFCOUNTABLE_SHADOW_UNCHECKED)
+#if defined(__GNUC__) || defined(__clang__)
+#define REFCOUNTABLE_COMPONENT_ABI __attribute__((abi_tag("refcountable_unchecked")))
+#else
+#error "REFCOUNTABLE_SHADOW_UNCHECKED requires abi_tag support (GCC or Clang)"
+#endif
+#else
+#define REFCOUNTABLE_COMPONENT_ABI
+#endif
+
+#if defined(REFCOUNTABLE_PINNED) && !defined(REFCOUNTABLE_HOLDERS)
+#define REFCOUNTABLE_HOLDERS
+#endif
+
+#if defined(REFCOUNTABLE_PINNED)
+#include "RefCountablePinned.hpp"
+#endif
+
+#if defined(REFCOUNTABLE_HOLDERS)
+#include "RefCountableHolders.hpp"
+#include "RefCountableWatchdog.hpp"
+#include <iostream>
+#else
+#define REFCOUNTABLE_HOLDER_PARAMETER
+#define REFCOUNTABLE_HOLDER_ATTACH(counter)
+#define REFCOUNTABLE_HOLDER_ARGUMENT
+#endif
+
+namespace refcountable_detail
+{
+   template <typename T>
+   constexpr std::string_view typeName()
+   {
+#if defined(__clang__) || defined(__GNUC__)
+      constexpr std::string_view function = __PRETTY_FUNCTION__;
+      constexpr size_t begin = function.find("T = ") + 4;
+      constexpr size_t end = function.find_first_of(";]", begin);
+      return function.substr(begin, end - begin);
+#elif defined(_MSC_VER)
+      constexpr std::string_view function = __FUNCSIG__;
+      constexpr size_t begin = function.find("typeName<") + 9;
+      constexpr size_t end = function.rfind(">(void)");
+      return function.substr(begin, end - begin);
+#else
+      return "unknown";
+#endif
+   }
+
+   // Uses-allocator construction of T, as std::make_obj_using_allocator
+   // does in C++20.
+   template <typename T, typename Alloc, typename... Args>
+   T makeUsingAllocator(const Alloc &alloc, Args &&...args)
+   {
+      if constexpr (!std::uses_allocator_v<T, Alloc>)
+         return T(std::forward<Args>(args)...);
+      else if constexpr (std::is_constructible_v<T, std::allocator_arg_t, const Alloc &, Args...>)
+         return T(std::allocator_arg, alloc, std::forward<Args>(args)...);
+      else
+         return T(std::forward<Args>(args)..., alloc);
+   }
+
+   template <typename T, typename... Args>
+   constexpr bool isCopyOf = false;
+
+   template <typename T, typename Arg>
+   constexpr bool isCopyOf<T, Arg> = std::is_same_v<std::decay_t<Arg>, T>;
+
+   // Handles hold a pointer to the counter they update. In modes that can
+   // leave a handle uncounted that pointer may be null, and the handle
+   // then skips every counter update; otherwise the null checks fold away.
+#if defined(REFCOUNTABLE_RUNTIME_CHECKS) || defined(REFCOUNTABLE_SAMPLED_COUNTING) || defined(REFCOUNTABLE_SHADOW_COUNTERS)
+   constexpr bool uncountedHandles = true;
+#else
+   constexpr bool uncountedHandles = false;
+#endif
+
+   // With REFCOUNTABLE_SAMPLED_COUNTING, objects that were not sampled for
+   // tracking keep this bit set in their counter and are never counted.
+#if defined(REFCOUNTABLE_SAMPLED_COUNTING)
+   constexpr size_t untrackedBit = size_t{1} << (sizeof(size_t) * 8 - 1);
+#else
+   constexpr size_t untrackedBit = 0;
+#endif
+
+   // Every RefCountable/RefCountableBase lifetime event and every counter
+   // update made by a handle goes through these functions, so that the
+   // optional instrumentation modes have a single place to hook into.
+   inline void constructed(std::atomic<size_t> &counter, std::string_view type)
+   {
+#if defined(REFCOUNTABLE_SAMPLED_COUNTING)
+      counter.store(RefCountableSampling::track() ? 0 : untrackedBit, std::memory_order_relaxed);
+#endif
+
+#if defined(REFCOUNTABLE_USDT)
+      REFCOUNTABLE_PROBE1(construct, &counter);
+#endif
+
+#if defined(REFCOUNTABLE_STATS)
+      RefCountableStats::constructed(counter, type);
+#endif
+
+#if defined(REFCOUNTABLE_TRACE)
+      RefCountableTrace::record(RefCountableTrace::Event::Construct, counter, 0);
+#endif
+
+#if defined(REFCOUNTABLE_CONTENTION)
+      RefCountableContention::constructed(counter, type);
+#endif
+
+#if defined(REFCOUNTABLE_RECORD)
+      RefCountableRecorder::record(RefCountableRecorder::Event::Construct, counter);
+#endif
+
+      (void)counter;
+      (void)type;
+   }
+
+   inline void destroyed(std::atomic<size_t> &counter)
+   {
+      const size_t references = counter.load(std::memory_order_relaxed) & ~untrackedBit;
+
+#if defined(REFCOUNTABLE_USDT)
+      REFCOUNTABLE_PROBE2(destroy, &counter, references);
+#endif
+
+#if defined(REFCOUNTABLE_STATS)
+      RefCountableStats::destroyed(counter);
+#endif
+
+#if defined(REFCOUNTABLE_TRACE)
+      RefCountableTrace::record(RefCountableTrace::Event::Destroy, counter, references);
+#endif
+
+#if defined(REFCOUNTABLE_CONTENTION)
+      RefCountableContention::destroyed(counter);
+#endif
+
+#if defined(REFCOUNTABLE_RECORD)
+      RefCountableRecorder::record(RefCountableRecorder::Event::Destroy, counter);
+#endif
+
+#if defined(REFCOUNTABLE_PINNED)
+      RefCountablePinned::destroyed(counter);
+#endif
+
+      if (references != 0)
+      {
+#if defined(REFCOUNTABLE_HOLDERS)
+         RefCountableHolders::print(std::cerr, counter);
+#endif
+
+         assert(false && "RefCountable destroyed while back references exist!");
+
+         std::terminate();
+      }
+   }
+
+   inline void acquire(std::atomic<size_t> &counter)
+   {
+      const size_t references = counter.fetch_add(1, std::memory_order_relaxed) + 1;
+
+#if defined(REFCOUNTABLE_USDT)
+      REFCOUNTABLE_PROBE1(acquire, &counter);
+#endif
+
+#if defined(REFCOUNTABLE_STATS)
+      RefCountableStats::acquired(counter);
+#endif
+
+#if defined(REFCOUNTABLE_TRACE)
+      RefCountableTrace::record(RefCountableTrace::Event::Acquire, counter, references);
+#endif
+
+#if defined(REFCOUNTABLE_CONTENTION)
+      RefCountableContention::touched(counter);
+#endif
+
+#if defined(REFCOUNTABLE_RECORD)
+      RefCountableRecorder::record(RefCountableRecorder::Event::Acquire, counter);
+#endif
+
+#if defined(REFCOUNTABLE_HOT_OBJECTS)
+      RefCountableHotObjects::sample(counter);
+#endif
+
+      (void)references;
+   }
+
+   inline void release(std::atomic<size_t> &counter)
+   {
+#if defined(REFCOUNTABLE_USDT)
+      REFCOUNTABLE_PROBE1(release, &counter);
+#endif
+
+#if defined(REFCOUNTABLE_STATS)
+      RefCountableStats::released(counter);
+#endif
+
+      // Release ordering lets drain() hand the object over for teardown
+      // once the last handle is gone.
+      const size_t references = counter.fetch_sub(1, std::memory_order_release) - 1;
+
+#if defined(REFCOUNTABLE_TRACE)
+      RefCountableTrace::record(RefCountableTrace::Event::Release, counter, references);
+#endif
+
+#if defined(REFCOUNTABLE_CONTENTION)
+      RefCountableContention::touched(counter);
+#endif
+
+#if defined(REFCOUNTABLE_RECORD)
+      RefCountableRecorder::record(RefCountableRecorder::Event::Release, counter);
+#endif
+
+#if defined(REFCOUNTABLE_HOT_OBJECTS)
+      RefCountableHotObjects::sample(counter);
+#endif
+
+      (void)references;
+   }
+
+   inline std::atomic<size_t> *counted(std::atomic<size_t> &counter)
+   {
+#if defined(REFCOUNTABLE_RUNTIME_CHECKS)
+      if (!RefCountableChecks::enabled())
+         return nullptr;
+#endif
+
+#if defined(REFCOUNTABLE_SAMPLED_COUNTING)
+      if (counter.load(std::memory_order_relaxed) & untrackedBit)
+         return nullptr;
+#endif
+
+      return &counter;
+   }
+
+   inline void acquire(std::atomic<size_t> *counter)
+   {
+      if (uncountedHandles && !counter)
+         return;
+
+      acquire(*counter);
+   }
+
+   inline void release(std::atomic<size_t> *counter)
+   {
+      if (uncountedHandles && !counter)
+         return;
+
+      release(*counter);
+   }
+
+   inline void assigned(std::atomic<size_t> *from, std::atomic<size_t> *to)
+   {
+#if defined(REFCOUNTABLE_USDT)
+      REFCOUNTABLE_PROBE2(assign, from, to);
+#endif
+
+      (void)from;
+      (void)to;
+   }
+
+   inline void resized(std::atomic<size_t> &counter, size_t bytes)
+   {
+#if defined(REFCOUNTABLE_PINNED)
+      RefCountablePinned::resize(counter, bytes);
+#endif
+
+      (void)counter;
+      (void)bytes;
+   }
+
+   template <typename T>
+   void sized(std::atomic<size_t> &counter, const T &value)
+   {
+#if defined(REFCOUNTABLE_PINNED)
+      resized(counter, RefCountablePayloadSize<T>{}(value));
+#endif
+
+      (void)counter;
+      (void)value;
+   }
+
+   // Waits until the last handle has released counter, spinning briefly
+   // and then backing off to sleeps of up to a millisecond. Returns false
+   // if deadline passes first. Untracked objects drain immediately.
+   inline bool drain(std::atomic<size_t> &counter, std::string_view type,
+                     std::chrono::steady_clock::time_point deadline)
+   {
+      const auto begin = std::chrono::steady_clock::now();
+
+      for (unsigned attempt = 0; (counter.load(std::memory_order_acquire) & ~untrackedBit) != 0; ++attempt)
+      {
+         if (attempt < 64)
+            continue;
+
+         const auto now = std::chrono::steady_clock::now();
+         if (now >= deadline)
+         {
+#if defined(REFCOUNTABLE_DRAIN)
+            RefCountableDrain::timedOut(type, now - begin);
+#endif
+            return false;
+         }
+
+         if (attempt < 128)
+            std::this_thread::yield();
+         else
+            std::this_thread::sleep_for(std::chrono::microseconds{std::min(1000u, attempt - 127)});
+      }
+
+#if defined(REFCOUNTABLE_DRAIN)
+      RefCountableDrain::drained(type, std::chrono::steady_clock::now() - begin);
+#endif
+
+      (void)type;
+      (void)begin;
+      return true;
+   }
+
+   inline bool referenced(const std::atomic<size_t> &counter)
+   {
+      return (counter.load(std::memory_order_acquire) & ~untrackedBit) != 0;
+   }
+
+   inline void mutated(std::atomic<size_t> &counter)
+   {
+#if defined(REFCOUNTABLE_TRACE)
+      RefCountableTrace::record(RefCountableTrace::Event::Mutate, counter, counter.load(std::memory_order_relaxed));
+#endif
+
+      (void)counter;
+   }
+}
+
 template <typename T>
 class RefCounted;
 
+template <typename T>
+class RefCountedOpt;
+
+class RefAny;
+
 template <typename T>
 class RefCountableBase
 {
-   friend class RefCounted<T>;
+   template <typename>
+   friend class RefCounted;
+   template <typename>
+   friend class RefCountedOpt;
+   friend class RefAny;
+   friend class RefCountablePinned;
+   friend class RefCountableHook;
+   template <typename>
+   friend class RefCountableShared;
 
 public:
    RefCountableBase &operator=(const RefCountableBase &) = delete;
    RefCountableBase &operator=(RefCountableBase &&) = delete;
 
+   // Blocks until no RefCounted refers to this object, so that an owner
+   // can tear it down while other threads may still hold handles.
+   void drain() const
+   {
+      refcountable_detail::drain(counter, refcountable_detail::typeName<T>(), std::chrono::steady_clock::time_point::max());
+   }
+
+   template <typename Rep, typename Period>
+   bool drainFor(const std::chrono::duration<Rep, Period> &timeout) const
+   {
+      return refcountable_detail::drain(counter, refcountable_detail::typeName<T>(),
+                                        std::chrono::steady_clock::now() + timeout);
+   }
+
+   // True while any counted RefCounted refers to this object, including
+   // aliasing handles to parts of it.
+   bool isReferenced() const
+   {
+      return refcountable_detail::referenced(counter);
+   }
+
 protected:
    virtual ~RefCountableBase()
    {
-      if (counter.load(std::memory_order_relaxed) != 0)
-      {
-         assert(false && "RefCountable destroyed while back references exist!");
-
-         std::terminate();
-      }
+      refcountable_detail::destroyed(counter);
+   }
+   RefCountableBase(T &value) : value{value}, counter{0}
+   {
+      refcountable_detail::constructed(counter, refcountable_detail::typeName<T>());
+      refcountable_detail::resized(counter, sizeof(T));
+   }
+   RefCountableBase(const RefCountableBase &rhs) : value{rhs.value}, counter{0}
+   {
+      refcountable_detail::constructed(counter, refcountable_detail::typeName<T>());
+      refcountable_detail::resized(counter, sizeof(T));
+   }
+   RefCountableBase(RefCountableBase &&rhs) : value{std::move(rhs.value)}, counter{0}
+   {
+      refcountable_detail::constructed(counter, refcountable_detail::typeName<T>());
+      refcountable_detail::resized(counter, sizeof(T));
    }
-   RefCountableBase(T &value) : value{value}, counter{0} {}
-   RefCountableBase(const RefCountableBase &rhs) : value{rhs.value}, counter{0} {}
-   RefCountableBase(RefCountableBase &&rhs) : value{std::move(rhs.value)}, counter{0} {}
 
 private:
+   REFCOUNTABLE_COMPONENT_ABI std::atomic<size_t> *handleCounter() const
+   {
+#if defined(REFCOUNTABLE_SHADOW_UNCHECKED)
+      return nullptr;
+#else
+      return refcountable_detail::counted(counter);
+#endif
+   }
+
    T &value;
    mutable std::atomic<size_t> counter;
 };
@@ -37,114 +491,318 @@ private:
 template <typename T>
 class RefCountable final
 {
-   friend class RefCounted<T>;
+   template <typename>
+   friend class RefCounted;
+   template <typename>
+   friend class RefCountedOpt;
+   friend class RefAny;
+   friend class RefCountablePinned;
+   template <typename>
+   friend class RefCountableShared;
 
 public:
    template <typename Arg, typename = std::enable_if_t<
                                !std::is_same_v<std::decay_t<Arg>, RefCountable>>>
-   explicit RefCountable(Arg &&arg)
-       : value{std::forward<Arg>(arg)}, counter{0}
+   REFCOUNTABLE_COMPONENT_ABI explicit RefCountable(Arg &&arg)
+       : value{std::forward<Arg>(arg)} REFCOUNTABLE_COUNTER_INIT
    {
+      created();
    }
 
-   template <typename Arg1, typename Arg2, typename... Args>
-   RefCountable(Arg1 &&arg1, Arg2 &&arg2, Args &&...args)
-       : value{std::forward<Arg1>(arg1), std::forward<Arg2>(arg2), std::forward<Args>(args)...}, counter{0} {}
+   template <typename Arg1, typename Arg2, typename... Args,
+             typename = std::enable_if_t<!std::is_same_v<std::decay_t<Arg1>, std::allocator_arg_t>>>
+   REFCOUNTABLE_COMPONENT_ABI RefCountable(Arg1 &&arg1, Arg2 &&arg2, Args &&...args)
+       : value{std::forward<Arg1>(arg1), std::forward<Arg2>(arg2), std::forward<Args>(args)...} REFCOUNTABLE_COUNTER_INIT
+   {
+      created();
+   }
 
-   RefCountable(RefCountable &&rhs) : value{std::move(rhs.value)}, counter{0}
+   // Allocator-extended constructors. The payload is built by uses-allocator
+   // construction, so with a std::pmr allocator both the payload and its
+   // inline counter live in the caller's memory resource, and containers
+   // such as std::pmr::vector<RefCountable<T>> pass theirs on to T.
+   template <typename Alloc, typename... Args,
+             typename = std::enable_if_t<!refcountable_detail::isCopyOf<RefCountable, Args...>>>
+   REFCOUNTABLE_COMPONENT_ABI RefCountable(std::allocator_arg_t, const Alloc &alloc, Args &&...args)
+       : value(refcountable_detail::makeUsingAllocator<T>(alloc, std::forward<Args>(args)...)) REFCOUNTABLE_COUNTER_INIT
    {
+      created();
    }
 
-   RefCountable(const RefCountable &rhs) : value{rhs.value}, counter{0}
+   template <typename Alloc>
+   REFCOUNTABLE_COMPONENT_ABI RefCountable(std::allocator_arg_t, const Alloc &alloc, RefCountable &&rhs)
+       : value(refcountable_detail::makeUsingAllocator<T>(alloc, std::move(rhs.value))) REFCOUNTABLE_COUNTER_INIT
    {
+      created();
    }
 
-   ~RefCountable()
+   template <typename Alloc>
+   REFCOUNTABLE_COMPONENT_ABI RefCountable(std::allocator_arg_t, const Alloc &alloc, const RefCountable &rhs)
+       : value(refcountable_detail::makeUsingAllocator<T>(alloc, rhs.value)) REFCOUNTABLE_COUNTER_INIT
    {
-      if (counter.load(std::memory_order_relaxed) != 0)
-      {
-         assert(false && "RefCountable destroyed while back references exist!");
+      created();
+   }
 
-         std::terminate();
+   REFCOUNTABLE_COMPONENT_ABI RefCountable(RefCountable &&rhs) : value{std::move(rhs.value)} REFCOUNTABLE_COUNTER_INIT
+   {
+      created();
+   }
+
+   REFCOUNTABLE_COMPONENT_ABI RefCountable(const RefCountable &rhs) : value{rhs.value} REFCOUNTABLE_COUNTER_INIT
+   {
+      created();
+   }
+
+   REFCOUNTABLE_COMPONENT_ABI ~RefCountable()
+   {
+#if defined(REFCOUNTABLE_SHADOW_COUNTERS)
+      static_assert(sizeof(RefCountable) == sizeof(T), "shadow counters must not change the layout");
+
+#if !defined(REFCOUNTABLE_SHADOW_UNCHECKED)
+      if (std::atomic<size_t> *counter = RefCountableShadow::find(this))
+      {
+         refcountable_detail::destroyed(*counter);
+         RefCountableShadow::erase(this);
       }
+#endif
+#else
+      refcountable_detail::destroyed(counter);
+#endif
    }
 
    T &get() { return value; }
    const T &get() const { return value; }
 
+   // Blocks until no RefCounted refers to this object, so that an owner
+   // can tear it down while other threads may still hold handles.
+   void drain() const
+   {
+      if (std::atomic<size_t> *counter = counterAddress())
+         refcountable_detail::drain(*counter, refcountable_detail::typeName<T>(), std::chrono::steady_clock::time_point::max());
+   }
+
+   template <typename Rep, typename Period>
+   bool drainFor(const std::chrono::duration<Rep, Period> &timeout) const
+   {
+      std::atomic<size_t> *counter = counterAddress();
+      return !counter || refcountable_detail::drain(*counter, refcountable_detail::typeName<T>(),
+                                                    std::chrono::steady_clock::now() + timeout);
+   }
+
+   // True while any counted RefCounted refers to this object, including
+   // aliasing handles to its elements or members. A container answers for
+   // all of its elements with one load.
+   bool isReferenced() const
+   {
+      const std::atomic<size_t> *counter = counterAddress();
+      return counter && refcountable_detail::referenced(*counter);
+   }
+
    RefCountable &operator=(const RefCountable &rhs)
    {
       value = rhs.value;
+      changed();
       return *this;
    }
 
    RefCountable &operator=(RefCountable &&rhs)
    {
       value = std::move(rhs.value);
+      changed();
       return *this;
    }
 
    RefCountable &operator=(const T &rhs)
    {
       value = rhs;
+      changed();
       return *this;
    }
 
    RefCountable &operator=(T &&rhs)
    {
       value = std::move(rhs);
+      changed();
       return *this;
    }
 
 private:
+   REFCOUNTABLE_COMPONENT_ABI void created()
+   {
+#if defined(REFCOUNTABLE_SHADOW_COUNTERS)
+#if defined(REFCOUNTABLE_SHADOW_UNCHECKED)
+      return;
+#endif
+      std::atomic<size_t> &counter = *RefCountableShadow::create(this);
+#endif
+
+      refcountable_detail::constructed(counter, refcountable_detail::typeName<T>());
+      refcountable_detail::sized(counter, value);
+   }
+
+   // Shadow counters are not looked up on assignment, so mutation events
+   // and size updates are only reported for inline counters.
+   void changed()
+   {
+#if !defined(REFCOUNTABLE_SHADOW_COUNTERS)
+      refcountable_detail::mutated(counter);
+      refcountable_detail::sized(counter, value);
+#endif
+   }
+
+   std::atomic<size_t> *counterAddress() const
+   {
+#if defined(REFCOUNTABLE_SHADOW_COUNTERS)
+      return RefCountableShadow::find(this);
+#else
+      return &counter;
+#endif
+   }
+
+   // The counter a new handle to this object updates, or nullptr if the
+   // handle is left uncounted.
+   REFCOUNTABLE_COMPONENT_ABI std::atomic<size_t> *handleCounter() const
+   {
+#if defined(REFCOUNTABLE_SHADOW_UNCHECKED)
+      return nullptr;
+#else
+      std::atomic<size_t> *counter = counterAddress();
+      return counter ? refcountable_detail::counted(*counter) : nullptr;
+#endif
+   }
+
    T value;
+#if !defined(REFCOUNTABLE_SHADOW_COUNTERS)
    mutable std::atomic<size_t> counter;
+#endif
 };
 
 template <typename T>
 class RefCounted
 {
+   template <typename>
+   friend class RefCounted;
+   template <typename>
+   friend class RefCountedOpt;
+   friend class RefAny;
+
 public:
    template <typename U>
-   RefCounted(RefCountable<U> &ref) : value{ref.value}, counter{ref.counter}
+   REFCOUNTABLE_COMPONENT_ABI RefCounted(RefCountable<U> &ref REFCOUNTABLE_HOLDER_PARAMETER)
+       : value{ref.value}, counter{ref.handleCounter()} REFCOUNTABLE_HOLDER_ATTACH(counter)
+   {
+      refcountable_detail::acquire(counter);
+   }
+
+   template <typename U>
+   REFCOUNTABLE_COMPONENT_ABI RefCounted(const RefCountable<U> &ref REFCOUNTABLE_HOLDER_PARAMETER)
+       : value{std::as_const(ref.value)}, counter{ref.handleCounter()} REFCOUNTABLE_HOLDER_ATTACH(counter)
+   {
+      refcountable_detail::acquire(counter);
+   }
+
+   template <typename U>
+   REFCOUNTABLE_COMPONENT_ABI RefCounted(RefCountableBase<U> &ref REFCOUNTABLE_HOLDER_PARAMETER)
+       : value{ref.value}, counter{ref.handleCounter()} REFCOUNTABLE_HOLDER_ATTACH(counter)
+   {
+      refcountable_detail::acquire(counter);
+   }
+
+   template <typename U>
+   REFCOUNTABLE_COMPONENT_ABI RefCounted(const RefCountableBase<U> &ref REFCOUNTABLE_HOLDER_PARAMETER)
+       : value{std::as_const(ref.value)}, counter{ref.handleCounter()} REFCOUNTABLE_HOLDER_ATTACH(counter)
+   {
+      refcountable_detail::acquire(counter);
+   }
+
+   // Aliasing constructors: the handle refers to member, an element or
+   // member of parent's payload, but counts on parent. Elements of a
+   // RefCountable container then need no counters of their own, and the
+   // container's destructor check and isReferenced() cover all of them.
+   //
+   // The counter only keeps parent alive, not member's address: member
+   // must stay where it is for as long as parent does, so an element of a
+   // vector that may reallocate or erase must not be aliased. A const
+   // parent, or a handle to a const payload, only yields const members.
+   template <typename U>
+   REFCOUNTABLE_COMPONENT_ABI RefCounted(RefCountable<U> &parent, T &member REFCOUNTABLE_HOLDER_PARAMETER)
+       : value{member}, counter{parent.handleCounter()} REFCOUNTABLE_HOLDER_ATTACH(counter)
+   {
+      refcountable_detail::acquire(counter);
+   }
+
+   template <typename U>
+   REFCOUNTABLE_COMPONENT_ABI RefCounted(const RefCountable<U> &parent, T &member REFCOUNTABLE_HOLDER_PARAMETER)
+       : value{member}, counter{parent.handleCounter()} REFCOUNTABLE_HOLDER_ATTACH(counter)
    {
-      counter.get().fetch_add(1, std::memory_order_relaxed);
+      static_assert(std::is_const_v<T>, "a const parent only yields const members");
+      refcountable_detail::acquire(counter);
    }
 
    template <typename U>
-   RefCounted(const RefCountable<U> &ref) : value{std::as_const(ref.value)}, counter{ref.counter}
+   REFCOUNTABLE_COMPONENT_ABI RefCounted(RefCountableBase<U> &parent, T &member REFCOUNTABLE_HOLDER_PARAMETER)
+       : value{member}, counter{parent.handleCounter()} REFCOUNTABLE_HOLDER_ATTACH(counter)
    {
-      counter.get().fetch_add(1, std::memory_order_relaxed);
+      refcountable_detail::acquire(counter);
    }
 
    template <typename U>
-   RefCounted(RefCountableBase<U> &ref) : value{ref.value}, counter{ref.counter}
+   REFCOUNTABLE_COMPONENT_ABI RefCounted(const RefCountableBase<U> &parent, T &member REFCOUNTABLE_HOLDER_PARAMETER)
+       : value{member}, counter{parent.handleCounter()} REFCOUNTABLE_HOLDER_ATTACH(counter)
    {
-      counter.get().fetch_add(1, std::memory_order_relaxed);
+      static_assert(std::is_const_v<T>, "a const parent only yields const members");
+      refcountable_detail::acquire(counter);
    }
 
    template <typename U>
-   RefCounted(const RefCountableBase<U> &ref) : value{std::as_const(ref.value)}, counter{ref.counter}
+   RefCounted(const RefCounted<U> &parent, T &member REFCOUNTABLE_HOLDER_PARAMETER)
+       : value{member}, counter{parent.counter} REFCOUNTABLE_HOLDER_ATTACH(counter)
    {
-      counter.get().fetch_add(1, std::memory_order_relaxed);
+      static_assert(!std::is_const_v<U> || std::is_const_v<T>, "a handle to a const payload only yields const members");
+      refcountable_detail::acquire(counter);
    }
 
    template <typename U>
-   RefCounted(RefCounted<U> &rhs) : value{rhs.value}, counter{rhs.counter}
+   RefCounted(RefCounted<U> &rhs REFCOUNTABLE_HOLDER_PARAMETER)
+       : value{rhs.value}, counter{rhs.counter} REFCOUNTABLE_HOLDER_ATTACH(counter)
    {
-      counter.get().fetch_add(1, std::memory_order_relaxed);
+      refcountable_detail::acquire(counter);
    }
 
    template <typename U>
-   RefCounted(const RefCounted<U> &rhs) : value{std::as_const(rhs.value)}, counter{rhs.counter}
+   RefCounted(const RefCounted<U> &rhs REFCOUNTABLE_HOLDER_PARAMETER)
+       : value{std::as_const(rhs.value)}, counter{rhs.counter} REFCOUNTABLE_HOLDER_ATTACH(counter)
    {
-      counter.get().fetch_add(1, std::memory_order_relaxed);
+      refcountable_detail::acquire(counter);
    }
 
    template <typename U>
-   RefCounted(RefCounted<U> &&rhs) : value{rhs.value}, counter{rhs.counter}
+   RefCounted(RefCounted<U> &&rhs REFCOUNTABLE_HOLDER_PARAMETER)
+       : value{rhs.value}, counter{rhs.counter} REFCOUNTABLE_HOLDER_ATTACH(counter)
    {
-      counter.get().fetch_add(1, std::memory_order_relaxed);
+      refcountable_detail::acquire(counter);
+   }
+
+   RefCounted(const RefCounted &rhs REFCOUNTABLE_HOLDER_PARAMETER)
+       : value{rhs.value}, counter{rhs.counter} REFCOUNTABLE_HOLDER_ATTACH(counter)
+   {
+      refcountable_detail::acquire(counter);
+   }
+
+   RefCounted &operator=(const RefCounted &rhs)
+   {
+#if defined(REFCOUNTABLE_HOLDERS)
+      RefCountableHolders::rebind(holder, rhs.counter);
+#endif
+
+      refcountable_detail::assigned(counter, rhs.counter);
+      refcountable_detail::acquire(rhs.counter);
+      refcountable_detail::release(counter);
+
+      value = rhs.value;
+      counter = rhs.counter;
+
+      return *this;
    }
 
    template <typename U>
@@ -153,19 +811,28 @@ public:
       if (this == &rhs)
          return *this;
 
-      counter.get().fetch_sub(1, std::memory_order_relaxed);
+#if defined(REFCOUNTABLE_HOLDERS)
+      RefCountableHolders::rebind(holder, rhs.counter);
+#endif
+
+      refcountable_detail::assigned(counter, rhs.counter);
+      refcountable_detail::release(counter);
 
       value = rhs.value;
       counter = rhs.counter;
 
-      counter.get().fetch_add(1, std::memory_order_relaxed);
+      refcountable_detail::acquire(counter);
 
       return *this;
    }
 
    ~RefCounted()
    {
-      counter.get().fetch_sub(1, std::memory_order_relaxed);
+#if defined(REFCOUNTABLE_HOLDERS)
+      RefCountableHolders::detach(holder);
+#endif
+
+      refcountable_detail::release(counter);
    }
 
    T &get()
@@ -180,5 +847,369 @@ public:
 
 private:
    std::reference_wrapper<T> value;
-   std::reference_wrapper<std::atomic<size_t>> counter;
+   std::atomic<size_t> *counter;
+
+#if defined(REFCOUNTABLE_HOLDERS)
+   RefCountableHolders::Holder *holder;
+#endif
+};
+
+template <typename T>
+class RefCountedOpt
+{
+public:
+   constexpr RefCountedOpt() noexcept : value{nullptr}, counter{nullptr} {}
+   constexpr RefCountedOpt(std::nullptr_t) noexcept : RefCountedOpt{} {}
+
+   template <typename U>
+   REFCOUNTABLE_COMPONENT_ABI RefCountedOpt(RefCountable<U> &ref REFCOUNTABLE_HOLDER_PARAMETER)
+       : value{&ref.value}, counter{ref.handleCounter()} REFCOUNTABLE_HOLDER_ATTACH(counter)
+   {
+      refcountable_detail::acquire(counter);
+   }
+
+   template <typename U>
+   REFCOUNTABLE_COMPONENT_ABI RefCountedOpt(const RefCountable<U> &ref REFCOUNTABLE_HOLDER_PARAMETER)
+       : value{&ref.value}, counter{ref.handleCounter()} REFCOUNTABLE_HOLDER_ATTACH(counter)
+   {
+      refcountable_detail::acquire(counter);
+   }
+
+   template <typename U>
+   REFCOUNTABLE_COMPONENT_ABI RefCountedOpt(RefCountableBase<U> &ref REFCOUNTABLE_HOLDER_PARAMETER)
+       : value{&ref.value}, counter{ref.handleCounter()} REFCOUNTABLE_HOLDER_ATTACH(counter)
+   {
+      refcountable_detail::acquire(counter);
+   }
+
+   template <typename U>
+   REFCOUNTABLE_COMPONENT_ABI RefCountedOpt(const RefCountableBase<U> &ref REFCOUNTABLE_HOLDER_PARAMETER)
+       : value{&ref.value}, counter{ref.handleCounter()} REFCOUNTABLE_HOLDER_ATTACH(counter)
+   {
+      refcountable_detail::acquire(counter);
+   }
+
+   RefCountedOpt(const RefCounted<T> &rhs REFCOUNTABLE_HOLDER_PARAMETER)
+       : value{&rhs.value.get()}, counter{rhs.counter} REFCOUNTABLE_HOLDER_ATTACH(counter)
+   {
+      refcountable_detail::acquire(counter);
+   }
+
+   RefCountedOpt(const RefCountedOpt &rhs REFCOUNTABLE_HOLDER_PARAMETER) noexcept : value{rhs.value}, counter{rhs.counter}
+   {
+#if defined(REFCOUNTABLE_HOLDERS)
+      if (value)
+         holder = RefCountableHolders::attach(counter, location);
+#endif
+
+      if (counter)
+         refcountable_detail::acquire(counter);
+   }
+
+   RefCountedOpt(RefCountedOpt &&rhs) noexcept : value{rhs.value}, counter{rhs.counter}
+   {
+      rhs.value = nullptr;
+      rhs.counter = nullptr;
+
+#if defined(REFCOUNTABLE_HOLDERS)
+      holder = rhs.holder;
+      rhs.holder = nullptr;
+#endif
+   }
+
+   RefCountedOpt &operator=(const RefCountedOpt &rhs) noexcept
+   {
+#if defined(REFCOUNTABLE_HOLDERS)
+      holder = RefCountableHolders::assign(holder, rhs.holder, rhs.counter);
+#endif
+
+      if (rhs.counter)
+         refcountable_detail::acquire(rhs.counter);
+
+      release();
+
+      value = rhs.value;
+      counter = rhs.counter;
+
+      return *this;
+   }
+
+   RefCountedOpt &operator=(RefCountedOpt &&rhs) noexcept
+   {
+      if (this == &rhs)
+         return *this;
+
+      release();
+
+      value = rhs.value;
+      counter = rhs.counter;
+
+      rhs.value = nullptr;
+      rhs.counter = nullptr;
+
+#if defined(REFCOUNTABLE_HOLDERS)
+      RefCountableHolders::detach(holder);
+      holder = rhs.holder;
+      rhs.holder = nullptr;
+#endif
+
+      return *this;
+   }
+
+   ~RefCountedOpt()
+   {
+#if defined(REFCOUNTABLE_HOLDERS)
+      RefCountableHolders::detach(holder);
+#endif
+
+      release();
+   }
+
+   void reset() noexcept
+   {
+#if defined(REFCOUNTABLE_HOLDERS)
+      RefCountableHolders::detach(holder);
+      holder = nullptr;
+#endif
+
+      release();
+
+      value = nullptr;
+      counter = nullptr;
+   }
+
+   explicit operator bool() const noexcept
+   {
+      return value != nullptr;
+   }
+
+   T &get()
+   {
+      assert(value && "RefCountedOpt is empty!");
+      return *value;
+   }
+
+   const T &get() const
+   {
+      assert(value && "RefCountedOpt is empty!");
+      return *value;
+   }
+
+private:
+   void release() noexcept
+   {
+      if (counter)
+         refcountable_detail::release(counter);
+   }
+
+   T *value;
+   std::atomic<size_t> *counter;
+
+#if defined(REFCOUNTABLE_HOLDERS)
+   RefCountableHolders::Holder *holder = nullptr;
+#endif
+};
+
+// A back reference to an object of any type, checked on access. RefAny is
+// three words, one more than RefCounted: the type tag is stored beside the
+// value and counter pointers so that holds() is a single compare, since
+// neither pointer has room to carry it. A moved-from RefAny holds nothing
+// and may only be assigned to or destroyed.
+class RefAny
+{
+public:
+   template <typename U>
+   REFCOUNTABLE_COMPONENT_ABI RefAny(RefCountable<U> &ref REFCOUNTABLE_HOLDER_PARAMETER)
+       : value{&ref.value}, counter{ref.handleCounter()}, type{&typeTag<U>} REFCOUNTABLE_HOLDER_ATTACH(counter)
+   {
+      refcountable_detail::acquire(counter);
+   }
+
+   template <typename U>
+   REFCOUNTABLE_COMPONENT_ABI RefAny(const RefCountable<U> &ref REFCOUNTABLE_HOLDER_PARAMETER)
+       : value{&ref.value}, counter{ref.handleCounter()}, type{&typeTag<const U>} REFCOUNTABLE_HOLDER_ATTACH(counter)
+   {
+      refcountable_detail::acquire(counter);
+   }
+
+   template <typename U>
+   REFCOUNTABLE_COMPONENT_ABI RefAny(RefCountableBase<U> &ref REFCOUNTABLE_HOLDER_PARAMETER)
+       : value{&ref.value}, counter{ref.handleCounter()}, type{&typeTag<U>} REFCOUNTABLE_HOLDER_ATTACH(counter)
+   {
+      refcountable_detail::acquire(counter);
+   }
+
+   template <typename U>
+   REFCOUNTABLE_COMPONENT_ABI RefAny(const RefCountableBase<U> &ref REFCOUNTABLE_HOLDER_PARAMETER)
+       : value{&ref.value}, counter{ref.handleCounter()}, type{&typeTag<const U>} REFCOUNTABLE_HOLDER_ATTACH(counter)
+   {
+      refcountable_detail::acquire(counter);
+   }
+
+   template <typename U>
+   RefAny(const RefCounted<U> &rhs REFCOUNTABLE_HOLDER_PARAMETER)
+       : value{&rhs.value.get()}, counter{rhs.counter}, type{&typeTag<U>} REFCOUNTABLE_HOLDER_ATTACH(counter)
+   {
+      refcountable_detail::acquire(counter);
+   }
+
+   RefAny(const RefAny &rhs REFCOUNTABLE_HOLDER_PARAMETER) : value{rhs.value}, counter{rhs.counter}, type{rhs.type}
+   {
+#if defined(REFCOUNTABLE_HOLDERS)
+      if (value)
+         holder = RefCountableHolders::attach(counter, location);
+#endif
+
+      if (counter)
+         refcountable_detail::acquire(counter);
+   }
+
+   RefAny(RefAny &&rhs) noexcept : value{rhs.value}, counter{rhs.counter}, type{rhs.type}
+   {
+      rhs.value = nullptr;
+      rhs.counter = nullptr;
+      rhs.type = nullptr;
+
+#if defined(REFCOUNTABLE_HOLDERS)
+      holder = rhs.holder;
+      rhs.holder = nullptr;
+#endif
+   }
+
+   RefAny &operator=(const RefAny &rhs)
+   {
+#if defined(REFCOUNTABLE_HOLDERS)
+      holder = RefCountableHolders::assign(holder, rhs.holder, rhs.counter);
+#endif
+
+      if (rhs.counter)
+         refcountable_detail::acquire(rhs.counter);
+
+      release();
+
+      value = rhs.value;
+      counter = rhs.counter;
+      type = rhs.type;
+
+      return *this;
+   }
+
+   RefAny &operator=(RefAny &&rhs) noexcept
+   {
+      if (this == &rhs)
+         return *this;
+
+      release();
+
+      value = rhs.value;
+      counter = rhs.counter;
+      type = rhs.type;
+
+      rhs.value = nullptr;
+      rhs.counter = nullptr;
+      rhs.type = nullptr;
+
+#if defined(REFCOUNTABLE_HOLDERS)
+      RefCountableHolders::detach(holder);
+      holder = rhs.holder;
+      rhs.holder = nullptr;
+#endif
+
+      return *this;
+   }
+
+   ~RefAny()
+   {
+#if defined(REFCOUNTABLE_HOLDERS)
+      RefCountableHolders::detach(holder);
+#endif
+
+      release();
+   }
+
+   template <typename T>
+   bool holds() const noexcept
+   {
+      if constexpr (std::is_const_v<T>)
+         return type == &typeTag<T> || type == &typeTag<std::remove_const_t<T>>;
+      else
+         return type == &typeTag<T>;
+   }
+
+   template <typename T>
+   T *getIf() noexcept
+   {
+      return holds<T>() ? static_cast<T *>(const_cast<void *>(value)) : nullptr;
+   }
+
+   template <typename T>
+   const T *getIf() const noexcept
+   {
+      return holds<const T>() ? static_cast<const T *>(value) : nullptr;
+   }
+
+   template <typename T>
+   T &get()
+   {
+      if (!holds<T>())
+         throw std::bad_cast{};
+
+      return *static_cast<T *>(const_cast<void *>(value));
+   }
+
+   template <typename T>
+   const T &get() const
+   {
+      if (!holds<const T>())
+         throw std::bad_cast{};
+
+      return *static_cast<const T *>(value);
+   }
+
+private:
+   void release() noexcept
+   {
+      if (counter)
+         refcountable_detail::release(counter);
+   }
+
+   template <typename T>
+   static constexpr char typeTag = 0;
+
+   const void *value;
+   std::atomic<size_t> *counter;
+   const char *type;
+
+#if defined(REFCOUNTABLE_HOLDERS)
+   RefCountableHolders::Holder *holder = nullptr;
+#endif
+};
+
+namespace std
+{
+   // RefCountable<T> takes an allocator exactly when T does.
+   template <typename T, typename Alloc>
+   struct uses_allocator<RefCountable<T>, Alloc> : uses_allocator<T, Alloc>
+   {
+   };
+}
+
+template <typename T>
+struct IsTriviallyRelocatable : std::is_trivially_copyable<T>
+{
+};
+
+template <typename T>
+struct IsTriviallyRelocatable<RefCounted<T>> : std::true_type
+{
+};
+
+template <typename T>
+struct IsTriviallyRelocatable<RefCountedOpt<T>> : std::true_type
+{
+};
+
+template <>
+struct IsTriviallyRelocatable<RefAny> : std::true_type
+{
 };
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <atomic>
+
+#if !defined(REFCOUNTABLE_RUNTIME_CHECKS_DEFAULT)
+#define REFCOUNTABLE_RUNTIME_CHECKS_DEFAULT false
+#endif
+
+// Process-wide switch for back-reference counting, used when
+// RefCountable.hpp is compiled with REFCOUNTABLE_RUNTIME_CHECKS. While
+// checks are disabled, new handles are created uncounted and never touch
+// the object's counter; handles created while enabled keep counting until
+// they are destroyed, so the switch can be flipped at any time.
+class RefCountableChecks
+{
+public:
+   static bool enabled()
+   {
+      return state.load(std::memory_order_relaxed);
+   }
+
+   static void enable()
+   {
+      state.store(true, std::memory_order_relaxed);
+   }
+
+   static void disable()
+   {
+      state.store(false, std::memory_order_relaxed);
+   }
+
+private:
+   static inline std::atomic<bool> state{REFCOUNTABLE_RUNTIME_CHECKS_DEFAULT};
+};
@@ -0,0 +1,284 @@
+#pragma once
+
+#include "RefCountable.hpp"
+
+#include <cstddef>
+#include <deque>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+template <typename... Ts>
+class RefCountableColumns;
+
+template <typename T>
+class RefCountedSlot
+{
+   template <typename...>
+   friend class RefCountableColumns;
+
+   using Column = std::conditional_t<std::is_const_v<T>,
+                                     const std::vector<std::remove_const_t<T>>,
+                                     std::vector<T>>;
+
+public:
+   RefCountedSlot(const RefCountedSlot &rhs REFCOUNTABLE_HOLDER_PARAMETER)
+       : column{rhs.column}, index{rhs.index}, counter{rhs.counter} REFCOUNTABLE_HOLDER_ATTACH(counter)
+   {
+      refcountable_detail::acquire(counter);
+   }
+
+   RefCountedSlot &operator=(const RefCountedSlot &rhs)
+   {
+#if defined(REFCOUNTABLE_HOLDERS)
+      RefCountableHolders::rebind(holder, rhs.counter);
+#endif
+
+      refcountable_detail::acquire(rhs.counter);
+      refcountable_detail::release(counter);
+
+      column = rhs.column;
+      index = rhs.index;
+      counter = rhs.counter;
+
+      return *this;
+   }
+
+   ~RefCountedSlot()
+   {
+#if defined(REFCOUNTABLE_HOLDERS)
+      RefCountableHolders::detach(holder);
+#endif
+
+      refcountable_detail::release(counter);
+   }
+
+   T &get()
+   {
+      return (*column)[index];
+   }
+
+   const T &get() const
+   {
+      return (*column)[index];
+   }
+
+   size_t row() const
+   {
+      return index;
+   }
+
+private:
+   RefCountedSlot(Column &column, size_t index, std::atomic<size_t> &counter REFCOUNTABLE_HOLDER_PARAMETER)
+       : column{&column}, index{index}, counter{refcountable_detail::counted(counter)} REFCOUNTABLE_HOLDER_ATTACH(this->counter)
+   {
+      refcountable_detail::acquire(this->counter);
+   }
+
+   Column *column;
+   size_t index;
+   std::atomic<size_t> *counter;
+
+#if defined(REFCOUNTABLE_HOLDERS)
+   RefCountableHolders::Holder *holder;
+#endif
+};
+
+template <typename T>
+struct IsTriviallyRelocatable<RefCountedSlot<T>> : std::true_type
+{
+};
+
+// The values of one column. Elements can be read and written through it,
+// but the column cannot be resized, so rows stay in step with the
+// references counted for them.
+template <typename T>
+class RefCountableColumnView
+{
+public:
+   using iterator = typename std::vector<T>::iterator;
+   using reference = typename std::vector<T>::reference;
+
+   explicit RefCountableColumnView(std::vector<T> &column) : first{column.begin()}, count{column.size()} {}
+
+   iterator begin() const { return first; }
+   iterator end() const { return first + static_cast<std::ptrdiff_t>(count); }
+   size_t size() const { return count; }
+
+   reference operator[](size_t row) const
+   {
+      return first[static_cast<std::ptrdiff_t>(row)];
+   }
+
+private:
+   iterator first;
+   size_t count;
+};
+
+// Stores one vector per column type and counts references per row.
+// Columns are not dense: an erased row stays in place, reset where its
+// types allow, until insert() reuses it, so code that scans a column must
+// skip rows for which contains() is false.
+template <typename... Ts>
+class RefCountableColumns
+{
+public:
+   RefCountableColumns() = default;
+   RefCountableColumns(const RefCountableColumns &) = delete;
+   RefCountableColumns &operator=(const RefCountableColumns &) = delete;
+
+   ~RefCountableColumns()
+   {
+      for (size_t row = 0; row < alive.size(); ++row)
+      {
+         if (alive[row])
+            refcountable_detail::destroyed(counters[row]);
+      }
+   }
+
+   // If constructing or assigning a column value throws, the values
+   // already placed for this row are rolled back and the table is left
+   // as it was.
+   template <typename... Args>
+   size_t insert(Args &&...args)
+   {
+      static_assert(sizeof...(Args) == sizeof...(Ts), "insert requires one value per column");
+
+      if (freeRows.empty())
+      {
+         const size_t row = alive.size();
+
+         alive.reserve(row + 1);
+         counters.emplace_back(0);
+         try
+         {
+            append(std::index_sequence_for<Ts...>{}, std::forward<Args>(args)...);
+         }
+         catch (...)
+         {
+            counters.pop_back();
+            throw;
+         }
+         alive.push_back(true);
+
+         refcountable_detail::constructed(counters[row], refcountable_detail::typeName<RefCountableColumns>());
+         return row;
+      }
+
+      const size_t row = freeRows.back();
+
+      assign(std::index_sequence_for<Ts...>{}, row, std::forward<Args>(args)...);
+      freeRows.pop_back();
+      alive[row] = true;
+
+      refcountable_detail::constructed(counters[row], refcountable_detail::typeName<RefCountableColumns>());
+      return row;
+   }
+
+   // Values of default-constructible columns are reset on erase, so a
+   // free row does not keep memory or resources alive; other columns
+   // keep theirs until the row is reused.
+   void erase(size_t row)
+   {
+      assert(alive[row] && "RefCountableColumns row erased twice!");
+
+      refcountable_detail::destroyed(counters[row]);
+      reset(std::index_sequence_for<Ts...>{}, row, sizeof...(Ts));
+
+      alive[row] = false;
+      freeRows.push_back(row);
+   }
+
+   bool contains(size_t row) const
+   {
+      return row < alive.size() && alive[row];
+   }
+
+   size_t rows() const
+   {
+      return alive.size();
+   }
+
+   // Views are invalidated by insert(), like vector iterators.
+   template <typename T>
+   RefCountableColumnView<T> column()
+   {
+      return RefCountableColumnView<T>{std::get<std::vector<T>>(columns)};
+   }
+
+   template <typename T>
+   const std::vector<T> &column() const
+   {
+      return std::get<std::vector<T>>(columns);
+   }
+
+   template <typename T>
+   RefCountedSlot<T> ref(size_t row REFCOUNTABLE_HOLDER_PARAMETER)
+   {
+      assert(contains(row) && "RefCountableColumns row does not exist!");
+
+      return RefCountedSlot<T>{std::get<std::vector<T>>(columns), row, counters[row] REFCOUNTABLE_HOLDER_ARGUMENT};
+   }
+
+   template <typename T>
+   RefCountedSlot<const T> ref(size_t row REFCOUNTABLE_HOLDER_PARAMETER) const
+   {
+      assert(contains(row) && "RefCountableColumns row does not exist!");
+
+      return RefCountedSlot<const T>{column<T>(), row, counters[row] REFCOUNTABLE_HOLDER_ARGUMENT};
+   }
+
+private:
+   template <size_t... Is, typename... Args>
+   void append(std::index_sequence<Is...>, Args &&...args)
+   {
+      size_t appended = 0;
+      try
+      {
+         ((std::get<Is>(columns).emplace_back(std::forward<Args>(args)), ++appended), ...);
+      }
+      catch (...)
+      {
+         ((Is < appended ? std::get<Is>(columns).pop_back() : void()), ...);
+         throw;
+      }
+   }
+
+   template <size_t... Is, typename... Args>
+   void assign(std::index_sequence<Is...>, size_t row, Args &&...args)
+   {
+      size_t assigned = 0;
+      try
+      {
+         ((std::get<Is>(columns)[row] = std::forward<Args>(args), ++assigned), ...);
+      }
+      catch (...)
+      {
+         reset(std::index_sequence<Is...>{}, row, assigned);
+         throw;
+      }
+   }
+
+   // Resets the first count columns of row where that is possible.
+   template <size_t... Is>
+   void reset(std::index_sequence<Is...>, size_t row, size_t count)
+   {
+      (resetValue(std::get<Is>(columns), row, Is < count), ...);
+   }
+
+   template <typename T>
+   static void resetValue(std::vector<T> &column, size_t row, bool selected)
+   {
+      if constexpr (std::is_default_constructible_v<T> && std::is_move_assignable_v<T>)
+      {
+         if (selected)
+            column[row] = T{};
+      }
+   }
+
+   std::tuple<std::vector<Ts>...> columns;
+   mutable std::deque<std::atomic<size_t>> counters;
+   std::vector<bool> alive;
+   std::vector<size_t> freeRows;
+};
@@ -0,0 +1,245 @@
+#pragma once
+
+#include "RefCountableSideTable.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <iterator>
+#include <mutex>
+#include <ostream>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Cross-thread counter contention profiler, fed when RefCountable.hpp is
+// compiled with REFCOUNTABLE_CONTENTION. For every object it counts the
+// counter updates, the distinct threads that made them and how often
+// consecutive updates came from different threads (ownership migrations),
+// and suggests the counting strategy the observed pattern would favour.
+class RefCountableContention
+{
+public:
+   enum class Strategy
+   {
+      // Only one thread ever touched the counter.
+      NonAtomic,
+      // Several threads, but nearly all updates come from the same one.
+      Biased,
+      // Ownership keeps migrating between threads.
+      Sharded,
+      // Too little traffic to matter.
+      Atomic
+   };
+
+   struct Contention
+   {
+      const void *object;
+      std::string_view type;
+      uint64_t updates;
+      uint64_t migrations;
+      size_t threads;
+      Strategy strategy;
+   };
+
+   struct Report
+   {
+      std::vector<Contention> types;
+      std::vector<Contention> objects;
+   };
+
+   // Objects and types are ranked by migrations, then by updates.
+   static Report report()
+   {
+      Registry &registry = instance();
+      Report report;
+      std::unordered_map<std::string_view, Totals> types;
+
+      {
+         std::lock_guard<std::mutex> guard{registry.typesLock};
+         types = registry.destroyed;
+      }
+
+      for (Shard &shard : registry.shards)
+      {
+         std::lock_guard<std::mutex> guard{shard.lock};
+         for (const auto &[object, record] : shard.objects)
+         {
+            report.objects.push_back(record.totals.contention(object, record.type));
+            types[record.type].add(record.totals);
+         }
+      }
+
+      for (const auto &[type, totals] : types)
+         report.types.push_back(totals.contention(nullptr, type));
+
+      auto ranking = [](const Contention &lhs, const Contention &rhs)
+      {
+         return lhs.migrations != rhs.migrations ? lhs.migrations > rhs.migrations : lhs.updates > rhs.updates;
+      };
+      std::sort(report.types.begin(), report.types.end(), ranking);
+      std::sort(report.objects.begin(), report.objects.end(), ranking);
+
+      return report;
+   }
+
+   static void writeText(std::ostream &out, const Report &report, size_t limit = 20)
+   {
+      out << "types:\n";
+      for (size_t i = 0; i < report.types.size() && i < limit; ++i)
+         write(out, report.types[i]);
+
+      out << "objects:\n";
+      for (size_t i = 0; i < report.objects.size() && i < limit; ++i)
+         write(out, report.objects[i]);
+   }
+
+   static const char *name(Strategy strategy)
+   {
+      switch (strategy)
+      {
+      case Strategy::NonAtomic:
+         return "non-atomic";
+      case Strategy::Biased:
+         return "biased";
+      case Strategy::Sharded:
+         return "sharded";
+      case Strategy::Atomic:
+         return "atomic";
+      }
+      return "";
+   }
+
+   static void constructed(const std::atomic<size_t> &counter, std::string_view type)
+   {
+      Shard &shard = instance().shards.of(&counter);
+      std::lock_guard<std::mutex> guard{shard.lock};
+      shard.objects[&counter] = Record{type, Totals{}, noThread};
+   }
+
+   static void destroyed(const std::atomic<size_t> &counter)
+   {
+      Registry &registry = instance();
+      Shard &shard = registry.shards.of(&counter);
+      std::unique_lock<std::mutex> guard{shard.lock};
+
+      const auto found = shard.objects.find(&counter);
+      if (found == shard.objects.end())
+         return;
+
+      const Record record = found->second;
+      shard.objects.erase(found);
+      guard.unlock();
+
+      std::lock_guard<std::mutex> typesGuard{registry.typesLock};
+      registry.destroyed[record.type].add(record.totals);
+   }
+
+   static void touched(const std::atomic<size_t> &counter)
+   {
+      const uint32_t thread = threadIndex();
+
+      Shard &shard = instance().shards.of(&counter);
+      std::lock_guard<std::mutex> guard{shard.lock};
+
+      const auto found = shard.objects.find(&counter);
+      if (found == shard.objects.end())
+         return;
+
+      Record &record = found->second;
+      ++record.totals.updates;
+      if (record.lastThread != thread && record.lastThread != noThread)
+         ++record.totals.migrations;
+      record.lastThread = thread;
+      record.totals.touchedBy(thread);
+   }
+
+private:
+   static constexpr uint32_t noThread = UINT32_MAX;
+   static constexpr uint64_t minimumUpdates = 1000;
+
+   struct Totals
+   {
+      void add(const Totals &rhs)
+      {
+         updates += rhs.updates;
+         migrations += rhs.migrations;
+
+         std::vector<uint32_t> merged;
+         merged.reserve(threads.size() + rhs.threads.size());
+         std::set_union(threads.begin(), threads.end(), rhs.threads.begin(), rhs.threads.end(), std::back_inserter(merged));
+         threads.swap(merged);
+      }
+
+      void touchedBy(uint32_t thread)
+      {
+         const auto position = std::lower_bound(threads.begin(), threads.end(), thread);
+         if (position == threads.end() || *position != thread)
+            threads.insert(position, thread);
+      }
+
+      Contention contention(const void *object, std::string_view type) const
+      {
+         const size_t count = threads.size();
+
+         Strategy strategy = Strategy::Atomic;
+         if (updates >= minimumUpdates && count <= 1)
+            strategy = Strategy::NonAtomic;
+         else if (updates >= minimumUpdates && migrations * 20 < updates)
+            strategy = Strategy::Biased;
+         else if (updates >= minimumUpdates)
+            strategy = Strategy::Sharded;
+
+         return Contention{object, type, updates, migrations, count, strategy};
+      }
+
+      uint64_t updates = 0;
+      uint64_t migrations = 0;
+      // Sorted indices of the threads that updated the counter.
+      std::vector<uint32_t> threads;
+   };
+
+   struct Record
+   {
+      std::string_view type;
+      Totals totals;
+      uint32_t lastThread;
+   };
+
+   struct ShardState
+   {
+      std::unordered_map<const void *, Record> objects;
+   };
+
+   using Shard = refcountable_detail::Shards<ShardState>::Shard;
+
+   struct Registry
+   {
+      refcountable_detail::Shards<ShardState> shards;
+      std::mutex typesLock;
+      std::unordered_map<std::string_view, Totals> destroyed;
+   };
+
+   static Registry &instance()
+   {
+      return refcountable_detail::leaked<Registry>();
+   }
+
+   // Every thread gets its own index, never reused, so migrations and
+   // distinct threads stay exact however many threads have existed.
+   static uint32_t threadIndex()
+   {
+      static std::atomic<uint32_t> next{0};
+      thread_local const uint32_t index = next.fetch_add(1, std::memory_order_relaxed);
+      return index;
+   }
+
+   static void write(std::ostream &out, const Contention &contention)
+   {
+      out << "  ";
+      if (contention.object)
+         out << contention.object << ' ';
+      out << contention.type << ": updates " << contention.updates << ", migrations " << contention.migrations
+          << ", threads " << contention.threads << ", suggested " << name(contention.strategy) << '\n';
+   }
+};
@@ -0,0 +1,200 @@
+#pragma once
+
+#include "RefCountableSideTable.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Log-linear latency histogram in the style of HdrHistogram: every power
+// of two is split into 16 linear buckets, so recorded values keep about
+// two significant digits from 1 ns up to the full 64-bit range.
+class RefCountableHistogram
+{
+public:
+   void record(uint64_t value)
+   {
+      ++counts[index(value)];
+      ++total;
+      minimum = std::min(minimum, value);
+      maximum = std::max(maximum, value);
+   }
+
+   uint64_t count() const { return total; }
+   uint64_t min() const { return total ? minimum : 0; }
+   uint64_t max() const { return maximum; }
+
+   // Lowest value of the bucket holding the given percentile, in [0, 100].
+   uint64_t percentile(double percentile) const
+   {
+      const uint64_t rank = static_cast<uint64_t>(percentile / 100.0 * static_cast<double>(total) + 0.5);
+
+      uint64_t seen = 0;
+      for (size_t bucket = 0; bucket < counts.size(); ++bucket)
+      {
+         seen += counts[bucket];
+         if (seen >= std::max<uint64_t>(rank, 1))
+            return std::clamp(lowest(bucket), min(), maximum);
+      }
+      return maximum;
+   }
+
+   // Calls visit(lowest value, count) for every non-empty bucket in order.
+   template <typename Visit>
+   void forEach(Visit &&visit) const
+   {
+      for (size_t bucket = 0; bucket < counts.size(); ++bucket)
+      {
+         if (counts[bucket] != 0)
+            visit(lowest(bucket), counts[bucket]);
+      }
+   }
+
+private:
+   static constexpr unsigned subBits = 4;
+   static constexpr uint64_t subBuckets = uint64_t{1} << subBits;
+
+   static size_t index(uint64_t value)
+   {
+      if (value < subBuckets)
+         return static_cast<size_t>(value);
+
+      unsigned exponent = 63;
+      while (!(value >> exponent))
+         --exponent;
+
+      return static_cast<size_t>((exponent - subBits + 1) * subBuckets + ((value >> (exponent - subBits)) & (subBuckets - 1)));
+   }
+
+   static uint64_t lowest(size_t bucket)
+   {
+      if (bucket < subBuckets)
+         return bucket;
+
+      const unsigned exponent = static_cast<unsigned>(bucket / subBuckets) + subBits - 1;
+      return (subBuckets + bucket % subBuckets) << (exponent - subBits);
+   }
+
+   std::array<uint64_t, (64 - subBits + 1) * subBuckets> counts{};
+   uint64_t total = 0;
+   uint64_t minimum = UINT64_MAX;
+   uint64_t maximum = 0;
+};
+
+// Per-type histograms of how long RefCountable::drain() waited for the
+// last RefCounted to be released. Fed when RefCountable.hpp is compiled
+// with REFCOUNTABLE_DRAIN; latencies are recorded in nanoseconds.
+// drainFor() calls that time out are kept out of the histogram, which
+// only holds completed drains, and counted per type along with the
+// longest wait among them.
+class RefCountableDrain
+{
+public:
+   struct TypeLatency
+   {
+      std::string_view type;
+      RefCountableHistogram histogram;
+      uint64_t timeouts;
+      uint64_t longestTimeout;
+   };
+
+   static std::vector<TypeLatency> snapshot()
+   {
+      Registry &registry = instance();
+      std::lock_guard<std::mutex> guard{registry.lock};
+
+      std::vector<TypeLatency> snapshot;
+      for (const auto &[type, record] : registry.types)
+         snapshot.push_back(TypeLatency{type, record.histogram, record.timeouts, record.longestTimeout});
+
+      std::sort(snapshot.begin(), snapshot.end(), [](const TypeLatency &lhs, const TypeLatency &rhs)
+                { return longest(lhs) > longest(rhs); });
+      return snapshot;
+   }
+
+   static void writeText(std::ostream &out, const std::vector<TypeLatency> &snapshot)
+   {
+      for (const TypeLatency &latency : snapshot)
+      {
+         const RefCountableHistogram &histogram = latency.histogram;
+         out << latency.type << ": drains " << histogram.count() << ", min " << histogram.min() << " ns, p50 "
+             << histogram.percentile(50) << " ns, p90 " << histogram.percentile(90) << " ns, p99 "
+             << histogram.percentile(99) << " ns, p99.9 " << histogram.percentile(99.9) << " ns, max "
+             << histogram.max() << " ns, timeouts " << latency.timeouts << " (longest " << latency.longestTimeout
+             << " ns)\n";
+      }
+   }
+
+   static void writeJson(std::ostream &out, const std::vector<TypeLatency> &snapshot)
+   {
+      out << "{\"types\": [";
+      for (size_t i = 0; i < snapshot.size(); ++i)
+      {
+         const RefCountableHistogram &histogram = snapshot[i].histogram;
+         out << (i ? ", " : "") << "{\"type\": ";
+         refcountable_detail::writeJsonString(out, snapshot[i].type);
+         out << ", \"count\": " << histogram.count() << ", \"min_ns\": " << histogram.min()
+             << ", \"max_ns\": " << histogram.max() << ", \"timeouts\": " << snapshot[i].timeouts
+             << ", \"longest_timeout_ns\": " << snapshot[i].longestTimeout << ", \"buckets\": [";
+
+         bool first = true;
+         histogram.forEach([&](uint64_t lowest, uint64_t count)
+                           {
+            out << (first ? "" : ", ") << '[' << lowest << ", " << count << ']';
+            first = false; });
+         out << "]}";
+      }
+      out << "]}\n";
+   }
+
+   static void drained(std::string_view type, std::chrono::steady_clock::duration latency)
+   {
+      const auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count();
+
+      Registry &registry = instance();
+      std::lock_guard<std::mutex> guard{registry.lock};
+      registry.types[type].histogram.record(static_cast<uint64_t>(std::max<decltype(nanoseconds)>(nanoseconds, 0)));
+   }
+
+   static void timedOut(std::string_view type, std::chrono::steady_clock::duration waited)
+   {
+      const auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(waited).count();
+
+      Registry &registry = instance();
+      std::lock_guard<std::mutex> guard{registry.lock};
+
+      Record &record = registry.types[type];
+      ++record.timeouts;
+      record.longestTimeout = std::max(record.longestTimeout, static_cast<uint64_t>(std::max<decltype(nanoseconds)>(nanoseconds, 0)));
+   }
+
+private:
+   struct Record
+   {
+      RefCountableHistogram histogram;
+      uint64_t timeouts = 0;
+      uint64_t longestTimeout = 0;
+   };
+
+   struct Registry
+   {
+      std::mutex lock;
+      std::unordered_map<std::string_view, Record> types;
+   };
+
+   static uint64_t longest(const TypeLatency &latency)
+   {
+      return std::max(latency.histogram.max(), latency.longestTimeout);
+   }
+
+   static Registry &instance()
+   {
+      return refcountable_detail::leaked<Registry>();
+   }
+};
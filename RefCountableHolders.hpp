@@ -0,0 +1,227 @@
+#pragma once
+
+#include "RefCountableSideTable.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <unordered_map>
+
+#if defined(__cpp_lib_source_location) || (defined(__has_include) && __has_include(<source_location>) && __cplusplus >= 202002L)
+#include <source_location>
+#endif
+
+#if defined(__cpp_lib_source_location)
+using RefCountableSourceLocation = std::source_location;
+#else
+class RefCountableSourceLocation
+{
+public:
+   static constexpr RefCountableSourceLocation current(const char *file = __builtin_FILE(),
+                                                       unsigned line = __builtin_LINE(),
+                                                       const char *function = __builtin_FUNCTION()) noexcept
+   {
+      return RefCountableSourceLocation{file, line, function};
+   }
+
+   constexpr const char *file_name() const noexcept { return file; }
+   constexpr unsigned line() const noexcept { return number; }
+   constexpr const char *function_name() const noexcept { return function; }
+
+private:
+   constexpr RefCountableSourceLocation(const char *file, unsigned line, const char *function)
+       : file{file}, number{line}, function{function}
+   {
+   }
+
+   const char *file;
+   unsigned number;
+   const char *function;
+};
+#endif
+
+// Tracks which handles hold each object, with the source
+// location that created the handle and the thread that last bound it.
+// Fed when RefCountable.hpp is compiled with REFCOUNTABLE_HOLDERS; the
+// holders of an object are printed when it is destroyed while still
+// referenced, and printAll() lists every outstanding holder on demand.
+class RefCountableHolders
+{
+public:
+   struct Holder
+   {
+      const void *object;
+      RefCountableSourceLocation location;
+      std::thread::id thread;
+      std::chrono::steady_clock::time_point since;
+      Holder *previous;
+      Holder *next;
+   };
+
+   // Holders of uncounted handles (a null counter) are kept but not listed.
+   static Holder *attach(const std::atomic<size_t> *counter, const RefCountableSourceLocation &location)
+   {
+      Holder *holder = new Holder{counter, location, std::this_thread::get_id(), now(),
+                                  nullptr, nullptr};
+      link(holder);
+      return holder;
+   }
+
+   // Nullable handles (RefCountedOpt, RefAny) have no holder while empty.
+   static void detach(Holder *holder)
+   {
+      if (!holder)
+         return;
+
+      unlink(holder);
+      delete holder;
+   }
+
+   // The holder of a nullable handle assigned from one held by from: it
+   // is dropped if from is null, and otherwise rebound or created at
+   // from's location.
+   static Holder *assign(Holder *holder, const Holder *from, const std::atomic<size_t> *counter)
+   {
+      if (!from)
+      {
+         detach(holder);
+         return nullptr;
+      }
+
+      if (!holder)
+         return attach(counter, from->location);
+
+      rebind(holder, counter);
+      return holder;
+   }
+
+   static void rebind(Holder *holder, const std::atomic<size_t> *counter)
+   {
+      unlink(holder);
+      holder->object = counter;
+      holder->thread = std::this_thread::get_id();
+      holder->since = now();
+      link(holder);
+   }
+
+   // Holders are stamped from a coarse clock while a RefCountableWatchdog
+   // keeps it ticking, which avoids a clock read per handle.
+   static std::chrono::steady_clock::time_point now()
+   {
+      const auto ticks = instance().coarseClock.load(std::memory_order_relaxed);
+      if (ticks != 0)
+         return std::chrono::steady_clock::time_point{std::chrono::steady_clock::duration{ticks}};
+
+      return std::chrono::steady_clock::now();
+   }
+
+   // Advances the coarse clock; a default-constructed time point stops it.
+   static void tick(std::chrono::steady_clock::time_point time)
+   {
+      instance().coarseClock.store(time.time_since_epoch().count(), std::memory_order_relaxed);
+   }
+
+   static void print(std::ostream &out, const std::atomic<size_t> &counter)
+   {
+      Shard &shard = instance().shards.of(&counter);
+      std::lock_guard<std::mutex> guard{shard.lock};
+
+      const auto found = shard.heads.find(&counter);
+      if (found != shard.heads.end())
+         print(out, found->second);
+   }
+
+   static void printAll(std::ostream &out)
+   {
+      forEach([&out](const Holder *head)
+              { print(out, head); });
+   }
+
+   // Calls visit with the first holder of every held object, under the
+   // lock of the shard that owns it; follow Holder::next for the rest.
+   template <typename Visit>
+   static void forEach(Visit &&visit)
+   {
+      for (Shard &shard : instance().shards)
+      {
+         std::lock_guard<std::mutex> guard{shard.lock};
+         for (const auto &[object, head] : shard.heads)
+            visit(static_cast<const Holder *>(head));
+      }
+   }
+
+private:
+   struct ShardState
+   {
+      std::unordered_map<const void *, Holder *> heads;
+   };
+
+   using Shard = refcountable_detail::Shards<ShardState>::Shard;
+
+   struct Registry
+   {
+      refcountable_detail::Shards<ShardState> shards;
+      std::atomic<std::chrono::steady_clock::rep> coarseClock{0};
+   };
+
+   static Registry &instance()
+   {
+      return refcountable_detail::leaked<Registry>();
+   }
+
+   static void link(Holder *holder)
+   {
+      if (!holder->object)
+         return;
+
+      Shard &shard = instance().shards.of(holder->object);
+      std::lock_guard<std::mutex> guard{shard.lock};
+
+      Holder *&head = shard.heads[holder->object];
+      holder->previous = nullptr;
+      holder->next = head;
+      if (head)
+         head->previous = holder;
+      head = holder;
+   }
+
+   static void unlink(Holder *holder)
+   {
+      if (!holder->object)
+         return;
+
+      Shard &shard = instance().shards.of(holder->object);
+      std::lock_guard<std::mutex> guard{shard.lock};
+
+      if (holder->next)
+         holder->next->previous = holder->previous;
+
+      if (holder->previous)
+         holder->previous->next = holder->next;
+      else if (holder->next)
+         shard.heads[holder->object] = holder->next;
+      else
+         shard.heads.erase(holder->object);
+   }
+
+   static void print(std::ostream &out, const Holder *head)
+   {
+      const auto now = RefCountableHolders::now();
+
+      out << "object " << head->object << " is held by:\n";
+      for (const Holder *holder = head; holder; holder = holder->next)
+      {
+         const auto age = std::chrono::duration_cast<std::chrono::milliseconds>(now - holder->since);
+         out << "  " << holder->location.file_name() << ':' << holder->location.line() << " in "
+             << holder->location.function_name() << " (thread " << holder->thread << ", " << age.count()
+             << " ms)\n";
+      }
+   }
+};
+
+#define REFCOUNTABLE_HOLDER_PARAMETER , RefCountableSourceLocation location = RefCountableSourceLocation::current()
+#define REFCOUNTABLE_HOLDER_ATTACH(counter) , holder{RefCountableHolders::attach(counter, location)}
+#define REFCOUNTABLE_HOLDER_ARGUMENT , location
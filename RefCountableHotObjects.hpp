@@ -0,0 +1,267 @@
+#pragma once
+
+#include "RefCountableSideTable.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+#if !defined(REFCOUNTABLE_HOT_OBJECTS_PERIOD)
+#define REFCOUNTABLE_HOT_OBJECTS_PERIOD 1024
+#endif
+
+// Sampled hot object detection, fed when RefCountable.hpp is compiled
+// with REFCOUNTABLE_HOT_OBJECTS. About one in setPeriod() counter updates
+// is fed into a per-thread count-min sketch and top-K list keyed by
+// object; threads fold them into a process-wide space-saving summary
+// every mergeInterval samples, and hottest() reports the result.
+class RefCountableHotObjects
+{
+public:
+   struct HotObject
+   {
+      const void *object;
+      uint64_t estimatedUpdates;
+   };
+
+   static void sample(const std::atomic<size_t> &counter)
+   {
+      thread_local uint32_t countdown = REFCOUNTABLE_HOT_OBJECTS_PERIOD;
+
+      if (--countdown != 0)
+         return;
+
+      ThreadState *state = threadState();
+      if (!state)
+      {
+         countdown = REFCOUNTABLE_HOT_OBJECTS_PERIOD;
+         return;
+      }
+
+      countdown = state->nextInterval();
+      state->sample(&counter);
+   }
+
+   static void setPeriod(uint32_t period)
+   {
+      instance().period.store(std::max<uint32_t>(1, period), std::memory_order_relaxed);
+   }
+
+   static std::vector<HotObject> hottest(size_t count = 16)
+   {
+      Registry &registry = instance();
+
+      std::lock_guard<std::mutex> guard{registry.lock};
+      for (const std::unique_ptr<ThreadState> &state : registry.threads)
+      {
+         std::lock_guard<std::mutex> stateGuard{state->lock};
+         state->mergeLocked(registry);
+      }
+
+      std::vector<HotObject> hottest;
+      for (const auto &[object, samples] : registry.summary)
+         hottest.push_back(HotObject{object, samples * registry.period.load(std::memory_order_relaxed)});
+
+      std::sort(hottest.begin(), hottest.end(), [](const HotObject &lhs, const HotObject &rhs)
+                { return lhs.estimatedUpdates > rhs.estimatedUpdates; });
+      if (hottest.size() > count)
+         hottest.resize(count);
+
+      return hottest;
+   }
+
+   static void writeText(std::ostream &out, const std::vector<HotObject> &hottest)
+   {
+      for (const HotObject &hot : hottest)
+         out << hot.object << ": ~" << hot.estimatedUpdates << " counter updates\n";
+   }
+
+private:
+   static constexpr size_t sketchDepth = 4;
+   static constexpr size_t sketchWidth = 1024;
+   static constexpr size_t localTopK = 32;
+   static constexpr size_t globalTopK = 128;
+   static constexpr uint32_t mergeInterval = 4096;
+
+   struct Registry;
+
+   struct ThreadState
+   {
+      ThreadState() : random{reinterpret_cast<uintptr_t>(this) | 1} {}
+
+      uint32_t nextInterval()
+      {
+         random ^= random << 13;
+         random ^= random >> 7;
+         random ^= random << 17;
+
+         const uint32_t period = instance().period.load(std::memory_order_relaxed);
+         return 1 + static_cast<uint32_t>(random % (2 * static_cast<uint64_t>(period)));
+      }
+
+      void sample(const void *object)
+      {
+         std::unique_lock<std::mutex> guard{lock};
+
+         uint32_t estimate = UINT32_MAX;
+         for (size_t row = 0; row < sketchDepth; ++row)
+         {
+            uint32_t &cell = sketch[row][hash(object, row)];
+            estimate = std::min(estimate, ++cell);
+         }
+
+         const auto found = std::find_if(topK.begin(), topK.end(), [object](const Entry &entry)
+                                         { return entry.object == object; });
+         if (found != topK.end())
+            found->samples = estimate;
+         else if (topK.size() < localTopK)
+            topK.push_back(Entry{object, estimate});
+         else
+         {
+            const auto minimum = std::min_element(topK.begin(), topK.end(), [](const Entry &lhs, const Entry &rhs)
+                                                  { return lhs.samples < rhs.samples; });
+            if (estimate > minimum->samples)
+               *minimum = Entry{object, estimate};
+         }
+
+         if (++samples < mergeInterval)
+            return;
+
+         // The registry lock is always taken before a thread's own lock.
+         guard.unlock();
+         Registry &registry = instance();
+         std::lock_guard<std::mutex> registryGuard{registry.lock};
+         guard.lock();
+         mergeLocked(registry);
+      }
+
+      void mergeLocked(Registry &registry)
+      {
+         for (const Entry &entry : topK)
+            registry.add(entry.object, entry.samples);
+
+         topK.clear();
+         for (auto &row : sketch)
+            row.fill(0);
+         samples = 0;
+      }
+
+      static size_t hash(const void *object, size_t row)
+      {
+         uint64_t key = reinterpret_cast<uintptr_t>(object) * 0x9e3779b97f4a7c15ull + row * 0xc2b2ae3d27d4eb4full;
+         key ^= key >> 29;
+         return static_cast<size_t>(key % sketchWidth);
+      }
+
+      struct Entry
+      {
+         const void *object;
+         uint64_t samples;
+      };
+
+      std::mutex lock;
+      std::array<std::array<uint32_t, sketchWidth>, sketchDepth> sketch{};
+      std::vector<Entry> topK;
+      uint32_t samples = 0;
+      uint64_t random;
+   };
+
+   struct Registry
+   {
+      // Weighted space-saving: when the summary is full, the entry with the
+      // fewest samples is replaced and its count is inherited.
+      void add(const void *object, uint64_t samples)
+      {
+         const auto found = summary.find(object);
+         if (found != summary.end())
+         {
+            found->second += samples;
+            return;
+         }
+
+         if (summary.size() < globalTopK)
+         {
+            summary.emplace(object, samples);
+            return;
+         }
+
+         auto minimum = std::min_element(summary.begin(), summary.end(), [](const auto &lhs, const auto &rhs)
+                                         { return lhs.second < rhs.second; });
+         const uint64_t inherited = minimum->second;
+         summary.erase(minimum);
+         summary.emplace(object, inherited + samples);
+      }
+
+      ThreadState *attach()
+      {
+         std::lock_guard<std::mutex> guard{lock};
+         if (!idle.empty())
+         {
+            ThreadState *state = idle.back();
+            idle.pop_back();
+            return state;
+         }
+
+         threads.push_back(std::make_unique<ThreadState>());
+         return threads.back().get();
+      }
+
+      // Folds an exiting thread's samples into the summary and keeps its
+      // state for the next new thread.
+      void detach(ThreadState *state)
+      {
+         std::lock_guard<std::mutex> guard{lock};
+         {
+            std::lock_guard<std::mutex> stateGuard{state->lock};
+            state->mergeLocked(*this);
+         }
+         idle.push_back(state);
+      }
+
+      std::atomic<uint32_t> period{REFCOUNTABLE_HOT_OBJECTS_PERIOD};
+      std::mutex lock;
+      std::vector<std::unique_ptr<ThreadState>> threads;
+      std::vector<ThreadState *> idle;
+      std::unordered_map<const void *, uint64_t> summary;
+   };
+
+   struct ThreadExit
+   {
+      ~ThreadExit()
+      {
+         instance().detach(current);
+         current = nullptr;
+         exited = true;
+      }
+   };
+
+   static Registry &instance()
+   {
+      return refcountable_detail::leaked<Registry>();
+   }
+
+   // Thread states belong to the registry and are never destroyed, so
+   // only trivially destructible thread_locals point at them. Counter
+   // updates made during thread or process exit, after the thread has
+   // handed its state back, are not sampled.
+   static ThreadState *threadState()
+   {
+      if (!current && !exited)
+      {
+         current = instance().attach();
+         thread_local ThreadExit exit;
+         (void)exit;
+      }
+
+      return current;
+   }
+
+   static inline thread_local ThreadState *current = nullptr;
+   static inline thread_local bool exited = false;
+};
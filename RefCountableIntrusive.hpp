@@ -0,0 +1,635 @@
+#pragma once
+
+#include "RefCountable.hpp"
+
+#include <functional>
+#include <iterator>
+#include <vector>
+
+// Intrusive containers for types deriving from RefCountableBase. The links
+// live in hooks that the object embeds, one per container it can be in at
+// a time, and the container is given the hook as a member pointer:
+//
+//    struct Task : RefCountableBase<Task>
+//    {
+//       Task() : RefCountableBase<Task>{*this} {}
+//
+//       RefCountableListHook<Task> runQueue;
+//       RefCountableHeapHook<Task> timers;
+//    };
+//
+//    RefCountableList<Task, &Task::runQueue> ready;
+//
+// Linking an object counts as a back reference to it, and unlinking
+// releases that reference, so an object still linked somewhere trips the
+// RefCountableBase destructor check. Containers never allocate per object;
+// only the hash set allocates its bucket array.
+
+class RefCountableHook
+{
+public:
+   RefCountableHook() = default;
+
+   // Copies of an object start out unlinked.
+   RefCountableHook(const RefCountableHook &) {}
+   RefCountableHook &operator=(const RefCountableHook &) { return *this; }
+
+   bool linked() const
+   {
+      return isLinked;
+   }
+
+protected:
+   template <typename U>
+   REFCOUNTABLE_COMPONENT_ABI void link(const RefCountableBase<U> &object REFCOUNTABLE_HOLDER_PARAMETER)
+   {
+      assert(!isLinked && "object is already linked through this hook!");
+
+      counter = object.handleCounter();
+      refcountable_detail::acquire(counter);
+
+#if defined(REFCOUNTABLE_HOLDERS)
+      holder = RefCountableHolders::attach(counter, location);
+#endif
+
+      isLinked = true;
+   }
+
+   void unlink()
+   {
+#if defined(REFCOUNTABLE_HOLDERS)
+      RefCountableHolders::detach(holder);
+#endif
+
+      refcountable_detail::release(counter);
+
+      counter = nullptr;
+      isLinked = false;
+   }
+
+private:
+   std::atomic<size_t> *counter = nullptr;
+   bool isLinked = false;
+
+#if defined(REFCOUNTABLE_HOLDERS)
+   RefCountableHolders::Holder *holder = nullptr;
+#endif
+};
+
+template <typename T>
+class RefCountableListHook : public RefCountableHook
+{
+   template <typename U, RefCountableListHook<U> U::*>
+   friend class RefCountableList;
+
+   T *prev = nullptr;
+   T *next = nullptr;
+};
+
+template <typename T>
+class RefCountableSetHook : public RefCountableHook
+{
+   template <typename U, RefCountableSetHook<U> U::*, typename, typename>
+   friend class RefCountableHashSet;
+
+   T *next = nullptr;
+   size_t hash = 0;
+};
+
+template <typename T>
+class RefCountableHeapHook : public RefCountableHook
+{
+   template <typename U, RefCountableHeapHook<U> U::*, typename>
+   friend class RefCountablePriorityQueue;
+
+   // prev is the parent for a first child and the left sibling otherwise.
+   T *prev = nullptr;
+   T *child = nullptr;
+   T *sibling = nullptr;
+};
+
+// Doubly linked list.
+template <typename T, RefCountableListHook<T> T::*Hook>
+class RefCountableList
+{
+public:
+   template <typename Value>
+   class Iterator
+   {
+      friend class RefCountableList;
+      template <typename>
+      friend class Iterator;
+
+   public:
+      using iterator_category = std::bidirectional_iterator_tag;
+      using value_type = std::remove_const_t<Value>;
+      using difference_type = std::ptrdiff_t;
+      using pointer = Value *;
+      using reference = Value &;
+
+      Iterator(T *node, const RefCountableList *list) : node{node}, list{list} {}
+
+      template <typename Other, typename = std::enable_if_t<std::is_const_v<Value> && !std::is_const_v<Other>>>
+      Iterator(const Iterator<Other> &rhs) : node{rhs.node}, list{rhs.list} {}
+
+      reference operator*() const { return *node; }
+      pointer operator->() const { return node; }
+
+      Iterator &operator++()
+      {
+         node = (node->*Hook).next;
+         return *this;
+      }
+
+      Iterator operator++(int)
+      {
+         Iterator previous = *this;
+         ++*this;
+         return previous;
+      }
+
+      Iterator &operator--()
+      {
+         node = node ? (node->*Hook).prev : list->tail;
+         return *this;
+      }
+
+      Iterator operator--(int)
+      {
+         Iterator previous = *this;
+         --*this;
+         return previous;
+      }
+
+      bool operator==(const Iterator &rhs) const { return node == rhs.node; }
+      bool operator!=(const Iterator &rhs) const { return node != rhs.node; }
+
+   private:
+      T *node;
+      const RefCountableList *list;
+   };
+
+   using iterator = Iterator<T>;
+   using const_iterator = Iterator<const T>;
+
+   RefCountableList() = default;
+   RefCountableList(const RefCountableList &) = delete;
+   RefCountableList &operator=(const RefCountableList &) = delete;
+
+   RefCountableList(RefCountableList &&rhs) noexcept : head{rhs.head}, tail{rhs.tail}, count{rhs.count}
+   {
+      rhs.head = rhs.tail = nullptr;
+      rhs.count = 0;
+   }
+
+   ~RefCountableList()
+   {
+      clear();
+   }
+
+   REFCOUNTABLE_COMPONENT_ABI void push_front(T &object REFCOUNTABLE_HOLDER_PARAMETER)
+   {
+      insert(head, object REFCOUNTABLE_HOLDER_ARGUMENT);
+   }
+
+   REFCOUNTABLE_COMPONENT_ABI void push_back(T &object REFCOUNTABLE_HOLDER_PARAMETER)
+   {
+      insert(nullptr, object REFCOUNTABLE_HOLDER_ARGUMENT);
+   }
+
+   // Links object before position, an iterator into this list.
+   REFCOUNTABLE_COMPONENT_ABI void insert(const_iterator position, T &object REFCOUNTABLE_HOLDER_PARAMETER)
+   {
+      insert(position.node, object REFCOUNTABLE_HOLDER_ARGUMENT);
+   }
+
+   void pop_front()
+   {
+      assert(head && "RefCountableList is empty!");
+      erase(*head);
+   }
+
+   void pop_back()
+   {
+      assert(tail && "RefCountableList is empty!");
+      erase(*tail);
+   }
+
+   // Unlinks object, which must be in this list.
+   void erase(T &object)
+   {
+      RefCountableListHook<T> &hook = object.*Hook;
+      assert(hook.linked() && "object is not in a RefCountableList!");
+
+      (hook.prev ? (hook.prev->*Hook).next : head) = hook.next;
+      (hook.next ? (hook.next->*Hook).prev : tail) = hook.prev;
+
+      hook.prev = hook.next = nullptr;
+      hook.unlink();
+      --count;
+   }
+
+   void clear()
+   {
+      while (head)
+         erase(*head);
+   }
+
+   T &front() { return *head; }
+   const T &front() const { return *head; }
+   T &back() { return *tail; }
+   const T &back() const { return *tail; }
+
+   iterator begin() { return {head, this}; }
+   iterator end() { return {nullptr, this}; }
+   const_iterator begin() const { return {head, this}; }
+   const_iterator end() const { return {nullptr, this}; }
+
+   bool empty() const
+   {
+      return count == 0;
+   }
+
+   size_t size() const
+   {
+      return count;
+   }
+
+private:
+   REFCOUNTABLE_COMPONENT_ABI void insert(T *before, T &object REFCOUNTABLE_HOLDER_PARAMETER)
+   {
+      RefCountableListHook<T> &hook = object.*Hook;
+      hook.link(object REFCOUNTABLE_HOLDER_ARGUMENT);
+
+      hook.next = before;
+      hook.prev = before ? (before->*Hook).prev : tail;
+
+      (hook.prev ? (hook.prev->*Hook).next : head) = &object;
+      (before ? (before->*Hook).prev : tail) = &object;
+
+      ++count;
+   }
+
+   T *head = nullptr;
+   T *tail = nullptr;
+   size_t count = 0;
+};
+
+// Hash set with chained buckets. Hash and Equal must also accept the key
+// types passed to find().
+template <typename T, RefCountableSetHook<T> T::*Hook, typename Hash = std::hash<T>, typename Equal = std::equal_to<>>
+class RefCountableHashSet
+{
+public:
+   explicit RefCountableHashSet(Hash hash = Hash{}, Equal equal = Equal{}) : hasher{std::move(hash)}, equal{std::move(equal)} {}
+
+   RefCountableHashSet(const RefCountableHashSet &) = delete;
+   RefCountableHashSet &operator=(const RefCountableHashSet &) = delete;
+
+   RefCountableHashSet(RefCountableHashSet &&rhs) noexcept
+       : hasher{std::move(rhs.hasher)}, equal{std::move(rhs.equal)}, buckets{std::move(rhs.buckets)}, count{rhs.count}
+   {
+      rhs.buckets.clear();
+      rhs.count = 0;
+   }
+
+   ~RefCountableHashSet()
+   {
+      clear();
+   }
+
+   // Links object unless an equal object is already in the set. Returns
+   // whether it was linked.
+   REFCOUNTABLE_COMPONENT_ABI bool insert(T &object REFCOUNTABLE_HOLDER_PARAMETER)
+   {
+      const size_t hash = hasher(std::as_const(object));
+      if (find(object, hash))
+         return false;
+
+      if (count + 1 > buckets.size())
+         rehash(buckets.empty() ? 16 : buckets.size() * 2);
+
+      RefCountableSetHook<T> &hook = object.*Hook;
+      hook.link(object REFCOUNTABLE_HOLDER_ARGUMENT);
+
+      T *&bucket = buckets[hash & (buckets.size() - 1)];
+      hook.hash = hash;
+      hook.next = bucket;
+      bucket = &object;
+
+      ++count;
+      return true;
+   }
+
+   // Unlinks object, which must be in this set.
+   void erase(T &object)
+   {
+      RefCountableSetHook<T> &hook = object.*Hook;
+      assert(hook.linked() && "object is not in a RefCountableHashSet!");
+
+      T **link = &buckets[hook.hash & (buckets.size() - 1)];
+      while (*link != &object)
+         link = &((*link)->*Hook).next;
+      *link = hook.next;
+
+      hook.next = nullptr;
+      hook.unlink();
+      --count;
+   }
+
+   template <typename Key>
+   T *find(const Key &key)
+   {
+      return find(key, hasher(key));
+   }
+
+   template <typename Key>
+   const T *find(const Key &key) const
+   {
+      return const_cast<RefCountableHashSet *>(this)->find(key, hasher(key));
+   }
+
+   template <typename Key>
+   bool contains(const Key &key) const
+   {
+      return find(key) != nullptr;
+   }
+
+   void clear()
+   {
+      for (T *&bucket : buckets)
+      {
+         while (T *object = bucket)
+         {
+            RefCountableSetHook<T> &hook = object->*Hook;
+            bucket = hook.next;
+
+            hook.next = nullptr;
+            hook.unlink();
+         }
+      }
+
+      count = 0;
+   }
+
+   template <typename Visit>
+   void forEach(Visit &&visit)
+   {
+      for (T *bucket : buckets)
+      {
+         for (T *object = bucket; object;)
+         {
+            T *next = (object->*Hook).next;
+            visit(*object);
+            object = next;
+         }
+      }
+   }
+
+   bool empty() const
+   {
+      return count == 0;
+   }
+
+   size_t size() const
+   {
+      return count;
+   }
+
+private:
+   template <typename Key>
+   T *find(const Key &key, size_t hash)
+   {
+      if (buckets.empty())
+         return nullptr;
+
+      for (T *object = buckets[hash & (buckets.size() - 1)]; object; object = (object->*Hook).next)
+      {
+         if ((object->*Hook).hash == hash && equal(std::as_const(*object), key))
+            return object;
+      }
+
+      return nullptr;
+   }
+
+   void rehash(size_t size)
+   {
+      std::vector<T *> resized(size, nullptr);
+
+      for (T *bucket : buckets)
+      {
+         while (T *object = bucket)
+         {
+            RefCountableSetHook<T> &hook = object->*Hook;
+            bucket = hook.next;
+
+            T *&target = resized[hook.hash & (size - 1)];
+            hook.next = target;
+            target = object;
+         }
+      }
+
+      buckets.swap(resized);
+   }
+
+   Hash hasher;
+   Equal equal;
+   std::vector<T *> buckets;
+   size_t count = 0;
+};
+
+// Pairing heap. As with std::priority_queue, top() is an object that no
+// other object compares greater than.
+template <typename T, RefCountableHeapHook<T> T::*Hook, typename Compare = std::less<T>>
+class RefCountablePriorityQueue
+{
+public:
+   explicit RefCountablePriorityQueue(Compare compare = Compare{}) : compare{std::move(compare)} {}
+
+   RefCountablePriorityQueue(const RefCountablePriorityQueue &) = delete;
+   RefCountablePriorityQueue &operator=(const RefCountablePriorityQueue &) = delete;
+
+   RefCountablePriorityQueue(RefCountablePriorityQueue &&rhs) noexcept
+       : compare{std::move(rhs.compare)}, root{rhs.root}, count{rhs.count}
+   {
+      rhs.root = nullptr;
+      rhs.count = 0;
+   }
+
+   ~RefCountablePriorityQueue()
+   {
+      clear();
+   }
+
+   REFCOUNTABLE_COMPONENT_ABI void push(T &object REFCOUNTABLE_HOLDER_PARAMETER)
+   {
+      (object.*Hook).link(object REFCOUNTABLE_HOLDER_ARGUMENT);
+
+      root = root ? meld(root, &object) : &object;
+      ++count;
+   }
+
+   T &top()
+   {
+      assert(root && "RefCountablePriorityQueue is empty!");
+      return *root;
+   }
+
+   const T &top() const
+   {
+      assert(root && "RefCountablePriorityQueue is empty!");
+      return *root;
+   }
+
+   void pop()
+   {
+      assert(root && "RefCountablePriorityQueue is empty!");
+      erase(*root);
+   }
+
+   // Unlinks object, which must be in this queue.
+   void erase(T &object)
+   {
+      assert((object.*Hook).linked() && "object is not in a RefCountablePriorityQueue!");
+
+      detach(object);
+      (object.*Hook).unlink();
+      --count;
+   }
+
+   // Restores the heap order after the priority of object, which must be
+   // in this queue, has changed.
+   void update(T &object)
+   {
+      assert((object.*Hook).linked() && "object is not in a RefCountablePriorityQueue!");
+
+      detach(object);
+      root = root ? meld(root, &object) : &object;
+   }
+
+   void clear()
+   {
+      // Walks the tree as a list: each child list is spliced in ahead of
+      // the remaining siblings before the node is unlinked.
+      for (T *object = root; object;)
+      {
+         RefCountableHeapHook<T> &hook = object->*Hook;
+
+         T *next = hook.sibling;
+         if (T *child = hook.child)
+         {
+            T *last = child;
+            while ((last->*Hook).sibling)
+               last = (last->*Hook).sibling;
+
+            (last->*Hook).sibling = next;
+            next = child;
+         }
+
+         hook.prev = hook.child = hook.sibling = nullptr;
+         hook.unlink();
+         object = next;
+      }
+
+      root = nullptr;
+      count = 0;
+   }
+
+   bool empty() const
+   {
+      return count == 0;
+   }
+
+   size_t size() const
+   {
+      return count;
+   }
+
+private:
+   // Takes object out of the tree, keeping it linked, and melds its
+   // children back in.
+   void detach(T &object)
+   {
+      RefCountableHeapHook<T> &hook = object.*Hook;
+
+      if (&object == root)
+         root = nullptr;
+      else
+      {
+         RefCountableHeapHook<T> &prev = hook.prev->*Hook;
+         (prev.child == &object ? prev.child : prev.sibling) = hook.sibling;
+         if (hook.sibling)
+            (hook.sibling->*Hook).prev = hook.prev;
+      }
+
+      T *children = mergePairs(hook.child);
+      hook.prev = hook.child = hook.sibling = nullptr;
+
+      if (children)
+         root = root ? meld(root, children) : children;
+   }
+
+   // Both arguments are roots without siblings.
+   T *meld(T *lhs, T *rhs)
+   {
+      if (compare(std::as_const(*lhs), std::as_const(*rhs)))
+         std::swap(lhs, rhs);
+
+      RefCountableHeapHook<T> &parent = lhs->*Hook;
+      RefCountableHeapHook<T> &child = rhs->*Hook;
+
+      child.sibling = parent.child;
+      if (parent.child)
+         (parent.child->*Hook).prev = rhs;
+
+      child.prev = lhs;
+      parent.child = rhs;
+
+      return lhs;
+   }
+
+   // Standard two-pass merge of a sibling list: meld pairs left to right,
+   // then meld the results right to left.
+   T *mergePairs(T *first)
+   {
+      T *pairs = nullptr;
+
+      while (first)
+      {
+         T *lhs = first;
+         T *rhs = (lhs->*Hook).sibling;
+         first = rhs ? (rhs->*Hook).sibling : nullptr;
+
+         (lhs->*Hook).prev = (lhs->*Hook).sibling = nullptr;
+         if (rhs)
+         {
+            (rhs->*Hook).prev = (rhs->*Hook).sibling = nullptr;
+            lhs = meld(lhs, rhs);
+         }
+
+         (lhs->*Hook).sibling = pairs;
+         pairs = lhs;
+      }
+
+      T *result = pairs;
+      if (result)
+      {
+         pairs = (result->*Hook).sibling;
+         (result->*Hook).sibling = nullptr;
+      }
+
+      while (pairs)
+      {
+         T *next = (pairs->*Hook).sibling;
+         (pairs->*Hook).sibling = nullptr;
+         result = meld(result, pairs);
+         pairs = next;
+      }
+
+      return result;
+   }
+
+   Compare compare;
+   T *root = nullptr;
+   size_t count = 0;
+};
@@ -0,0 +1,176 @@
+#pragma once
+
+#include "RefCountableSideTable.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "RefCountableHolders.hpp"
+
+template <typename T>
+class RefCountable;
+
+template <typename T>
+class RefCountableBase;
+
+// Number of bytes a RefCountable<T> payload keeps alive. The default is
+// sizeof(T); specialise it for payloads that own heap memory, e.g. to
+// return capacity() * sizeof(value_type) for a buffer.
+template <typename T>
+struct RefCountablePayloadSize
+{
+   size_t operator()(const T &) const { return sizeof(T); }
+};
+
+// Attributes the payload size of every RefCountable to the RefCounted
+// handles that hold it, when RefCountable.hpp is compiled with
+// REFCOUNTABLE_PINNED. The size is taken from RefCountablePayloadSize
+// on construction and assignment; RefCountableBase payloads start at
+// sizeof(T) and, like payloads that grow in place, are updated through
+// resize(), which is meant to be called from allocator hooks.
+class RefCountablePinned
+{
+public:
+   struct Site
+   {
+      RefCountableSourceLocation location;
+      size_t references;
+      size_t objects;
+      size_t bytes;
+      std::chrono::steady_clock::duration oldest;
+   };
+
+   struct Report
+   {
+      size_t trackedBytes = 0;
+      size_t pinnedBytes = 0;
+      size_t pinnedObjects = 0;
+      std::vector<Site> sites;
+   };
+
+   template <typename T>
+   static void resize(const RefCountable<T> &object, size_t bytes)
+   {
+      if (const std::atomic<size_t> *counter = object.counterAddress())
+         resize(*counter, bytes);
+   }
+
+   template <typename T>
+   static void resize(const RefCountableBase<T> &object, size_t bytes)
+   {
+      resize(object.counter, bytes);
+   }
+
+   static void resize(const std::atomic<size_t> &counter, size_t bytes)
+   {
+      Shard &shard = instance().shards.of(&counter);
+      std::lock_guard<std::mutex> guard{shard.lock};
+      shard.bytes[&counter] = bytes;
+   }
+
+   static void destroyed(const std::atomic<size_t> &counter)
+   {
+      Shard &shard = instance().shards.of(&counter);
+      std::lock_guard<std::mutex> guard{shard.lock};
+      shard.bytes.erase(&counter);
+   }
+
+   // Objects held by at least one reference older than threshold count as
+   // pinned. Their bytes are charged once to every source location that
+   // holds such a reference, and the sites are ranked by bytes.
+   static Report report(std::chrono::steady_clock::duration threshold)
+   {
+      Report report;
+      std::unordered_map<const void *, size_t> bytes;
+      for (Shard &shard : instance().shards)
+      {
+         std::lock_guard<std::mutex> guard{shard.lock};
+         for (const auto &[object, size] : shard.bytes)
+         {
+            bytes.emplace(object, size);
+            report.trackedBytes += size;
+         }
+      }
+
+      const auto now = std::chrono::steady_clock::now();
+      std::map<std::pair<std::string, unsigned>, Site> sites;
+      RefCountableHolders::forEach([&](const RefCountableHolders::Holder *head)
+                                   {
+         const auto found = bytes.find(head->object);
+         const size_t size = found != bytes.end() ? found->second : 0;
+
+         std::unordered_set<Site *> charged;
+         for (const RefCountableHolders::Holder *holder = head; holder; holder = holder->next)
+         {
+            const auto age = now - holder->since;
+            if (age < threshold)
+               continue;
+
+            const auto key = std::make_pair(std::string{holder->location.file_name()}, unsigned(holder->location.line()));
+            Site &site = sites.try_emplace(key, Site{holder->location, 0, 0, 0, {}}).first->second;
+            ++site.references;
+            site.oldest = std::max(site.oldest, age);
+            if (charged.insert(&site).second)
+            {
+               ++site.objects;
+               site.bytes += size;
+            }
+         }
+
+         if (!charged.empty())
+         {
+            ++report.pinnedObjects;
+            report.pinnedBytes += size;
+         } });
+
+      for (auto &[key, site] : sites)
+         report.sites.push_back(site);
+
+      std::sort(report.sites.begin(), report.sites.end(), [](const Site &lhs, const Site &rhs)
+                { return lhs.bytes > rhs.bytes; });
+
+      return report;
+   }
+
+   static void writeText(std::ostream &out, const Report &report, size_t limit = 20)
+   {
+      out << report.pinnedBytes << " of " << report.trackedBytes << " bytes pinned by " << report.pinnedObjects
+          << " objects\n";
+
+      for (size_t i = 0; i < report.sites.size() && i < limit; ++i)
+      {
+         const Site &site = report.sites[i];
+         const auto oldest = std::chrono::duration_cast<std::chrono::milliseconds>(site.oldest);
+         out << "  " << site.bytes << " bytes in " << site.objects << " objects, " << site.references
+             << " references, oldest " << oldest.count() << " ms: " << site.location.file_name() << ':'
+             << site.location.line() << " in " << site.location.function_name() << '\n';
+      }
+   }
+
+private:
+   struct ShardState
+   {
+      std::unordered_map<const void *, size_t> bytes;
+   };
+
+   using Shard = refcountable_detail::Shards<ShardState>::Shard;
+
+   struct Registry
+   {
+      refcountable_detail::Shards<ShardState> shards;
+   };
+
+   static Registry &instance()
+   {
+      return refcountable_detail::leaked<Registry>();
+   }
+};
@@ -0,0 +1,28 @@
+#pragma once
+
+// USDT probes for RefCountable lifetime events, enabled by compiling with
+// REFCOUNTABLE_USDT. Each probe site is a single NOP plus an ELF note until
+// a tracer attaches, e.g.
+//
+//    bpftrace -e 'usdt:./app:refcountable:destroy /arg1 != 0/ { printf("%p\n", arg0); }'
+//
+// Probes (arguments are the counter address and, where given, a count):
+//    refcountable:construct(counter)
+//    refcountable:acquire(counter)
+//    refcountable:release(counter)
+//    refcountable:assign(old counter, new counter)
+//    refcountable:destroy(counter, outstanding references)
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define REFCOUNTABLE_HAS_SDT
+#endif
+#endif
+
+#if defined(REFCOUNTABLE_HAS_SDT)
+#define REFCOUNTABLE_PROBE1(name, arg1) STAP_PROBE1(refcountable, name, arg1)
+#define REFCOUNTABLE_PROBE2(name, arg1, arg2) STAP_PROBE2(refcountable, name, arg1, arg2)
+#else
+#error "REFCOUNTABLE_USDT requires <sys/sdt.h> (systemtap-sdt-dev or systemtap-sdt-devel)"
+#endif
@@ -0,0 +1,239 @@
+#pragma once
+
+#include "RefCountableSideTable.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+// Records every construct, acquire, release and destroy event while
+// recording is started, when RefCountable.hpp is compiled with
+// REFCOUNTABLE_RECORD. Unlike RefCountableTrace nothing is overwritten:
+// each thread appends to its own growing list of chunks, and write()
+// saves the capture in a compact binary format that bench/TraceReplay
+// replays against different counter policies.
+class RefCountableRecorder
+{
+public:
+   enum class Event : uint8_t
+   {
+      Construct,
+      Acquire,
+      Release,
+      Destroy
+   };
+
+   // File layout: one Header followed by Header::records Records, in host
+   // byte order. Objects are numbered densely in address order, so that
+   // neighbouring ids were neighbours in memory.
+   struct Header
+   {
+      char magic[8];
+      uint32_t version;
+      uint32_t threads;
+      uint64_t objects;
+      uint64_t records;
+   };
+
+   struct Record
+   {
+      uint64_t nanoseconds;
+      uint32_t object;
+      uint16_t thread;
+      Event event;
+      uint8_t reserved;
+   };
+
+   static void start()
+   {
+      instance().recording.store(true, std::memory_order_relaxed);
+   }
+
+   static void stop()
+   {
+      instance().recording.store(false, std::memory_order_relaxed);
+   }
+
+   // Discards everything recorded so far, so that a capture can cover
+   // just the phase of interest. Recording itself is left as it is.
+   static void clear()
+   {
+      Registry &registry = instance();
+
+      std::lock_guard<std::mutex> guard{registry.lock};
+      registry.since.store(now(), std::memory_order_relaxed);
+      for (const std::unique_ptr<Buffer> &buffer : registry.buffers)
+         buffer->clear();
+   }
+
+   static void record(Event event, const std::atomic<size_t> &counter)
+   {
+      Registry &registry = instance();
+      if (!registry.recording.load(std::memory_order_relaxed))
+         return;
+
+      thread_local Buffer *buffer = registry.attach();
+      buffer->append(Entry{now(), &counter, event});
+   }
+
+   // Writes everything recorded so far, ordered by time. Returns the
+   // number of records written.
+   static uint64_t write(std::ostream &out)
+   {
+      Registry &registry = instance();
+
+      std::vector<Record> records;
+      std::vector<const void *> addresses;
+      uint32_t threads = 0;
+      {
+         std::lock_guard<std::mutex> guard{registry.lock};
+         const uint64_t since = registry.since.load(std::memory_order_relaxed);
+         threads = static_cast<uint32_t>(registry.buffers.size());
+         for (const std::unique_ptr<Buffer> &buffer : registry.buffers)
+         {
+            buffer->forEach([&](const Entry &entry)
+                            {
+               if (entry.nanoseconds < since)
+                  return;
+               records.push_back(Record{entry.nanoseconds, 0, buffer->thread, entry.event, 0});
+               addresses.push_back(entry.object); });
+         }
+      }
+
+      std::vector<const void *> objects = addresses;
+      std::sort(objects.begin(), objects.end());
+      objects.erase(std::unique(objects.begin(), objects.end()), objects.end());
+
+      std::unordered_map<const void *, uint32_t> ids;
+      for (const void *object : objects)
+         ids.emplace(object, static_cast<uint32_t>(ids.size()));
+      for (size_t i = 0; i < records.size(); ++i)
+         records[i].object = ids[addresses[i]];
+
+      std::stable_sort(records.begin(), records.end(), [](const Record &lhs, const Record &rhs)
+                       { return lhs.nanoseconds < rhs.nanoseconds; });
+
+      Header header{};
+      std::memcpy(header.magic, magic, sizeof(header.magic));
+      header.version = version;
+      header.threads = threads;
+      header.objects = objects.size();
+      header.records = records.size();
+
+      out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+      out.write(reinterpret_cast<const char *>(records.data()), static_cast<std::streamsize>(records.size() * sizeof(Record)));
+      return records.size();
+   }
+
+   static bool read(std::istream &in, Header &header, std::vector<Record> &records)
+   {
+      if (!in.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+          std::memcmp(header.magic, magic, sizeof(header.magic)) != 0 || header.version != version)
+         return false;
+
+      records.resize(header.records);
+      return static_cast<bool>(in.read(reinterpret_cast<char *>(records.data()),
+                                       static_cast<std::streamsize>(records.size() * sizeof(Record))));
+   }
+
+private:
+   static constexpr char magic[8] = {'R', 'C', 'R', 'E', 'C', 'O', 'R', 'D'};
+   static constexpr uint32_t version = 1;
+   static constexpr size_t chunkSize = 4096;
+
+   struct Entry
+   {
+      uint64_t nanoseconds;
+      const void *object;
+      Event event;
+   };
+
+   struct Chunk
+   {
+      std::array<Entry, chunkSize> entries;
+      std::atomic<size_t> size{0};
+   };
+
+   // Only the owning thread appends. Readers see the entries below each
+   // chunk's published size, and take the lock to walk the chunk list,
+   // which the writer only changes when it starts a new chunk. clear()
+   // frees every chunk but the one being appended to; entries left in
+   // that one are skipped by time instead.
+   struct Buffer
+   {
+      explicit Buffer(uint16_t thread) : thread{thread}, current{chunks.emplace_back(std::make_unique<Chunk>()).get()} {}
+
+      void append(const Entry &entry)
+      {
+         size_t size = current->size.load(std::memory_order_relaxed);
+         if (size == chunkSize)
+         {
+            std::lock_guard<std::mutex> guard{lock};
+            current = chunks.emplace_back(std::make_unique<Chunk>()).get();
+            size = 0;
+         }
+
+         current->entries[size] = entry;
+         current->size.store(size + 1, std::memory_order_release);
+      }
+
+      void clear()
+      {
+         std::lock_guard<std::mutex> guard{lock};
+         chunks.erase(chunks.begin(), chunks.end() - 1);
+      }
+
+      template <typename Visit>
+      void forEach(Visit &&visit)
+      {
+         std::lock_guard<std::mutex> guard{lock};
+         for (const std::unique_ptr<Chunk> &chunk : chunks)
+         {
+            const size_t size = chunk->size.load(std::memory_order_acquire);
+            for (size_t i = 0; i < size; ++i)
+               visit(chunk->entries[i]);
+         }
+      }
+
+      const uint16_t thread;
+      std::mutex lock;
+      std::vector<std::unique_ptr<Chunk>> chunks;
+      Chunk *current;
+   };
+
+   struct Registry
+   {
+      Buffer *attach()
+      {
+         std::lock_guard<std::mutex> guard{lock};
+         buffers.push_back(std::make_unique<Buffer>(static_cast<uint16_t>(buffers.size())));
+         return buffers.back().get();
+      }
+
+      const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+      std::atomic<bool> recording{false};
+      std::atomic<uint64_t> since{0};
+      std::mutex lock;
+      std::vector<std::unique_ptr<Buffer>> buffers;
+   };
+
+   static Registry &instance()
+   {
+      return refcountable_detail::leaked<Registry>();
+   }
+
+   static uint64_t now()
+   {
+      const auto elapsed = std::chrono::steady_clock::now() - instance().startTime;
+      return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+   }
+};
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#if !defined(REFCOUNTABLE_SAMPLED_COUNTING_PROBABILITY)
+#define REFCOUNTABLE_SAMPLED_COUNTING_PROBABILITY 0.01
+#endif
+
+// Decides which objects are tracked when RefCountable.hpp is compiled
+// with REFCOUNTABLE_SAMPLED_COUNTING. Each RefCountable draws once at
+// construction; untracked objects mark their counter with a spare high
+// bit, and handles to them skip every counter update.
+class RefCountableSampling
+{
+public:
+   static void setProbability(double probability)
+   {
+      threshold.store(toThreshold(probability), std::memory_order_relaxed);
+   }
+
+   static double probability()
+   {
+      return static_cast<double>(threshold.load(std::memory_order_relaxed)) / 4294967296.0;
+   }
+
+   static bool track()
+   {
+      thread_local uint64_t random = seed();
+
+      random ^= random << 13;
+      random ^= random >> 7;
+      random ^= random << 17;
+
+      return (random >> 32) < threshold.load(std::memory_order_relaxed);
+   }
+
+private:
+   static constexpr uint64_t toThreshold(double probability)
+   {
+      return probability <= 0 ? 0 : probability >= 1 ? uint64_t{1} << 32 : static_cast<uint64_t>(probability * 4294967296.0);
+   }
+
+   static uint64_t seed()
+   {
+      static std::atomic<uint64_t> next{0x9e3779b97f4a7c15ull};
+      return next.fetch_add(0x9e3779b97f4a7c15ull, std::memory_order_relaxed) | 1;
+   }
+
+   static inline std::atomic<uint64_t> threshold{toThreshold(REFCOUNTABLE_SAMPLED_COUNTING_PROBABILITY)};
+};
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "RefCountableSideTable.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <memory_resource>
+#include <mutex>
+#include <unordered_map>
+
+// Shadow counter table used when RefCountable.hpp is compiled with
+// REFCOUNTABLE_SHADOW_COUNTERS. Objects constructed in checked units
+// get a counter keyed by their address; handles look it up once and then
+// update it directly, so only creating a handle from the object itself
+// takes a shard lock. Objects built in unchecked units have no entry.
+// Entries come from a pool per shard rather than one heap allocation
+// each; the table outlives any caller's memory resource, so it does not
+// use theirs.
+class RefCountableShadow
+{
+public:
+   static std::atomic<size_t> *create(const void *object)
+   {
+      Shard &shard = instance().shards.of(object);
+      std::lock_guard<std::mutex> guard{shard.lock};
+
+      // An entry left by an object destroyed in an unchecked unit is
+      // taken over by the next object at the same address.
+      std::atomic<size_t> &counter = shard.counters.try_emplace(object, 0).first->second;
+      counter.store(0, std::memory_order_relaxed);
+      return &counter;
+   }
+
+   static std::atomic<size_t> *find(const void *object)
+   {
+      Shard &shard = instance().shards.of(object);
+      std::lock_guard<std::mutex> guard{shard.lock};
+
+      const auto found = shard.counters.find(object);
+      return found != shard.counters.end() ? &found->second : nullptr;
+   }
+
+   static void erase(const void *object)
+   {
+      Shard &shard = instance().shards.of(object);
+      std::lock_guard<std::mutex> guard{shard.lock};
+      shard.counters.erase(object);
+   }
+
+private:
+   struct ShardState
+   {
+      std::pmr::unsynchronized_pool_resource pool;
+      std::pmr::unordered_map<const void *, std::atomic<size_t>> counters{&pool};
+   };
+
+   using Shard = refcountable_detail::Shards<ShardState>::Shard;
+
+   struct Registry
+   {
+      refcountable_detail::Shards<ShardState> shards;
+   };
+
+   static Registry &instance()
+   {
+      return refcountable_detail::leaked<Registry>();
+   }
+};
@@ -0,0 +1,176 @@
+#pragma once
+
+#include "RefCountable.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+
+// Exposes a RefCountable or RefCountableBase object as std::shared_ptr<T>
+// for APIs that require one. The shared_ptr control block is built in
+// storage embedded here, so sharing does not allocate:
+//
+//    struct Session : RefCountableBase<Session>
+//    {
+//       Session() : RefCountableBase<Session>{*this}, shared{*this} {}
+//       RefCountableShared<Session> shared;
+//    };
+//
+//    thirdParty.subscribe(session.shared.share());
+//
+// All shared_ptrs handed out while one is alive share one control block,
+// which holds a single back reference to the object until the last of them
+// is gone. The destructor check then catches objects destroyed while
+// shared_ptrs exist. weak_ptrs keep the embedded block itself alive, so
+// destroying a RefCountableShared while any shared_ptr or weak_ptr still
+// uses its block terminates the same way.
+//
+// If share() is called after every shared_ptr is gone but while a weak_ptr
+// still holds the old block, the new control block is allocated on the
+// heap instead.
+template <typename T>
+class RefCountableShared
+{
+public:
+   template <typename U>
+   REFCOUNTABLE_COMPONENT_ABI explicit RefCountableShared(RefCountable<U> &object)
+       : value{object.value}, object{&object}, handleCounter{&counterOf<RefCountable<U>>}
+   {
+   }
+
+   template <typename U>
+   REFCOUNTABLE_COMPONENT_ABI explicit RefCountableShared(RefCountableBase<U> &object)
+       : value{object.value}, object{&object}, handleCounter{&counterOf<RefCountableBase<U>>}
+   {
+   }
+
+   RefCountableShared(const RefCountableShared &) = delete;
+   RefCountableShared &operator=(const RefCountableShared &) = delete;
+
+   ~RefCountableShared()
+   {
+      {
+         std::lock_guard<std::mutex> guard{lock};
+         self.reset();
+      }
+
+      if (blockInUse.load(std::memory_order_acquire))
+      {
+         assert(false && "RefCountableShared destroyed while shared_ptr or weak_ptr references exist!");
+
+         std::terminate();
+      }
+   }
+
+   // Under REFCOUNTABLE_HOLDERS the back reference is held at the call
+   // that created the current control block.
+#if defined(REFCOUNTABLE_HOLDERS)
+   REFCOUNTABLE_COMPONENT_ABI std::shared_ptr<T> share(RefCountableSourceLocation location = RefCountableSourceLocation::current())
+#else
+   REFCOUNTABLE_COMPONENT_ABI std::shared_ptr<T> share()
+#endif
+   {
+      std::lock_guard<std::mutex> guard{lock};
+
+      if (std::shared_ptr<T> shared = self.lock())
+         return shared;
+
+      // Dropping the last internal weak_ptr frees the previous embedded
+      // block unless a caller's weak_ptr still holds it.
+      self.reset();
+
+      std::atomic<size_t> *counter = handleCounter(object);
+      refcountable_detail::acquire(counter);
+
+#if defined(REFCOUNTABLE_HOLDERS)
+      Release release{counter, RefCountableHolders::attach(counter, location)};
+#else
+      Release release{counter};
+#endif
+
+      std::shared_ptr<T> shared{&value, release, Allocator<T>{this}};
+      self = shared;
+      return shared;
+   }
+
+   // Number of shared_ptrs sharing the current control block.
+   long useCount() const
+   {
+      std::lock_guard<std::mutex> guard{lock};
+      return self.use_count();
+   }
+
+private:
+   template <typename Object>
+   REFCOUNTABLE_COMPONENT_ABI static std::atomic<size_t> *counterOf(const void *object)
+   {
+      return static_cast<const Object *>(object)->handleCounter();
+   }
+
+   struct Release
+   {
+      void operator()(T *) const
+      {
+#if defined(REFCOUNTABLE_HOLDERS)
+         RefCountableHolders::detach(holder);
+#endif
+
+         refcountable_detail::release(counter);
+      }
+
+      std::atomic<size_t> *counter;
+#if defined(REFCOUNTABLE_HOLDERS)
+      RefCountableHolders::Holder *holder;
+#endif
+   };
+
+   // Hands out the embedded block when it is free and large enough for the
+   // standard library's control block type, and the heap otherwise.
+   template <typename U>
+   struct Allocator
+   {
+      using value_type = U;
+
+      explicit Allocator(RefCountableShared *owner) : owner{owner} {}
+
+      template <typename V>
+      Allocator(const Allocator<V> &rhs) : owner{rhs.owner} {}
+
+      U *allocate(size_t count)
+      {
+         if constexpr (sizeof(U) <= sizeof(block) && alignof(U) <= alignof(std::max_align_t))
+         {
+            if (count == 1 && !owner->blockInUse.exchange(true, std::memory_order_acquire))
+               return reinterpret_cast<U *>(owner->block);
+         }
+
+         return std::allocator<U>{}.allocate(count);
+      }
+
+      void deallocate(U *pointer, size_t count)
+      {
+         if (static_cast<void *>(pointer) == owner->block)
+            owner->blockInUse.store(false, std::memory_order_release);
+         else
+            std::allocator<U>{}.deallocate(pointer, count);
+      }
+
+      template <typename V>
+      bool operator==(const Allocator<V> &rhs) const { return owner == rhs.owner; }
+
+      template <typename V>
+      bool operator!=(const Allocator<V> &rhs) const { return owner != rhs.owner; }
+
+      RefCountableShared *owner;
+   };
+
+   T &value;
+   const void *object;
+   std::atomic<size_t> *(*handleCounter)(const void *object);
+
+   alignas(std::max_align_t) unsigned char block[8 * sizeof(void *)];
+   std::atomic<bool> blockInUse{false};
+
+   mutable std::mutex lock;
+   std::weak_ptr<T> self;
+};
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string_view>
+
+// Internal building blocks shared by the instrumentation side tables
+// (stats, contention, holders, pinned bytes, shadow counters).
+namespace refcountable_detail
+{
+// Per-object state split across cache-line aligned, separately locked
+// shards keyed by address, so unrelated objects rarely share a lock.
+template <typename State, size_t Count = 64>
+class Shards
+{
+public:
+   struct alignas(64) Shard : State
+   {
+      std::mutex lock;
+   };
+
+   Shard &of(const void *key)
+   {
+      return shards[(reinterpret_cast<uintptr_t>(key) >> 4) % Count];
+   }
+
+   Shard *begin() { return shards.data(); }
+   Shard *end() { return shards.data() + Count; }
+
+private:
+   std::array<Shard, Count> shards;
+};
+
+// Never destroyed, so handles released by static and thread_local
+// destructors can still reach it during exit.
+template <typename T>
+T &leaked()
+{
+   static T *instance = new T;
+   return *instance;
+}
+
+inline void writeJsonString(std::ostream &out, std::string_view text)
+{
+   out << '"';
+   for (char c : text)
+   {
+      if (c == '"' || c == '\\')
+         out << '\\';
+      out << c;
+   }
+   out << '"';
+}
+} // namespace refcountable_detail
@@ -0,0 +1,240 @@
+#pragma once
+
+#include "RefCountableSideTable.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Per-object and per-type reference statistics. The counters are only
+// fed when RefCountable.hpp is compiled with REFCOUNTABLE_STATS defined.
+class RefCountableStats
+{
+public:
+   struct ObjectStats
+   {
+      const void *object;
+      std::string_view type;
+      uint64_t acquisitions;
+      size_t references;
+      size_t peakReferences;
+   };
+
+   struct TypeStats
+   {
+      std::string_view type;
+      uint64_t acquisitions;
+      size_t references;
+      size_t peakReferences;
+      size_t objects;
+      size_t peakObjects;
+   };
+
+   struct Snapshot
+   {
+      std::vector<TypeStats> types;
+      std::vector<ObjectStats> objects;
+   };
+
+   static Snapshot snapshot()
+   {
+      Registry &registry = instance();
+      Snapshot snapshot;
+
+      {
+         std::lock_guard<std::mutex> guard{registry.typesLock};
+         for (const auto &[name, type] : registry.types)
+            snapshot.types.push_back(type->stats());
+      }
+
+      if (registry.unregistered.acquisitions.load(std::memory_order_relaxed) != 0)
+         snapshot.types.push_back(registry.unregistered.stats());
+
+      for (Shard &shard : registry.shards)
+      {
+         std::lock_guard<std::mutex> guard{shard.lock};
+         for (const auto &[object, record] : shard.objects)
+         {
+            snapshot.objects.push_back(ObjectStats{object, record.type->name, record.acquisitions,
+                                                   record.references, record.peakReferences});
+         }
+      }
+
+      std::sort(snapshot.types.begin(), snapshot.types.end(), [](const TypeStats &lhs, const TypeStats &rhs)
+                { return lhs.acquisitions > rhs.acquisitions; });
+      std::sort(snapshot.objects.begin(), snapshot.objects.end(), [](const ObjectStats &lhs, const ObjectStats &rhs)
+                { return lhs.acquisitions > rhs.acquisitions; });
+
+      return snapshot;
+   }
+
+   static void writeText(std::ostream &out, const Snapshot &snapshot)
+   {
+      for (const TypeStats &type : snapshot.types)
+      {
+         out << type.type << ": objects " << type.objects << " (peak " << type.peakObjects << "), references "
+             << type.references << " (peak " << type.peakReferences << "), acquisitions " << type.acquisitions << '\n';
+      }
+
+      for (const ObjectStats &object : snapshot.objects)
+      {
+         out << "  " << object.object << ' ' << object.type << ": references " << object.references << " (peak "
+             << object.peakReferences << "), acquisitions " << object.acquisitions << '\n';
+      }
+   }
+
+   static void writeJson(std::ostream &out, const Snapshot &snapshot)
+   {
+      out << "{\"types\": [";
+      for (size_t i = 0; i < snapshot.types.size(); ++i)
+      {
+         const TypeStats &type = snapshot.types[i];
+         out << (i ? ", " : "") << "{\"type\": ";
+         refcountable_detail::writeJsonString(out, type.type);
+         out << ", \"objects\": " << type.objects << ", \"peak_objects\": " << type.peakObjects
+             << ", \"references\": " << type.references << ", \"peak_references\": " << type.peakReferences
+             << ", \"acquisitions\": " << type.acquisitions << '}';
+      }
+
+      out << "], \"objects\": [";
+      for (size_t i = 0; i < snapshot.objects.size(); ++i)
+      {
+         const ObjectStats &object = snapshot.objects[i];
+         out << (i ? ", " : "") << "{\"object\": \"" << object.object << "\", \"type\": ";
+         refcountable_detail::writeJsonString(out, object.type);
+         out << ", \"references\": " << object.references << ", \"peak_references\": " << object.peakReferences
+             << ", \"acquisitions\": " << object.acquisitions << '}';
+      }
+      out << "]}\n";
+   }
+
+   static void constructed(const std::atomic<size_t> &counter, std::string_view name)
+   {
+      TypeRecord &type = instance().type(name);
+      raiseTo(type.peakObjects, type.objects.fetch_add(1, std::memory_order_relaxed) + 1);
+
+      Shard &shard = instance().shards.of(&counter);
+      std::lock_guard<std::mutex> guard{shard.lock};
+      shard.objects[&counter] = ObjectRecord{&type, 0, 0, 0};
+   }
+
+   static void destroyed(const std::atomic<size_t> &counter)
+   {
+      Shard &shard = instance().shards.of(&counter);
+      std::lock_guard<std::mutex> guard{shard.lock};
+
+      const auto found = shard.objects.find(&counter);
+      if (found == shard.objects.end())
+         return;
+
+      found->second.type->objects.fetch_sub(1, std::memory_order_relaxed);
+      shard.objects.erase(found);
+   }
+
+   static void acquired(const std::atomic<size_t> &counter)
+   {
+      Shard &shard = instance().shards.of(&counter);
+      std::lock_guard<std::mutex> guard{shard.lock};
+
+      const auto found = shard.objects.find(&counter);
+      TypeRecord &type = found == shard.objects.end() ? instance().unregistered : *found->second.type;
+
+      type.acquisitions.fetch_add(1, std::memory_order_relaxed);
+      raiseTo(type.peakReferences, type.references.fetch_add(1, std::memory_order_relaxed) + 1);
+
+      if (found != shard.objects.end())
+      {
+         ObjectRecord &record = found->second;
+         ++record.acquisitions;
+         record.peakReferences = std::max(record.peakReferences, ++record.references);
+      }
+   }
+
+   static void released(const std::atomic<size_t> &counter)
+   {
+      Shard &shard = instance().shards.of(&counter);
+      std::lock_guard<std::mutex> guard{shard.lock};
+
+      const auto found = shard.objects.find(&counter);
+      TypeRecord &type = found == shard.objects.end() ? instance().unregistered : *found->second.type;
+
+      type.references.fetch_sub(1, std::memory_order_relaxed);
+
+      if (found != shard.objects.end())
+         --found->second.references;
+   }
+
+private:
+   struct TypeRecord
+   {
+      explicit TypeRecord(std::string_view name) : name{name} {}
+
+      TypeStats stats() const
+      {
+         return TypeStats{name, acquisitions.load(std::memory_order_relaxed),
+                          references.load(std::memory_order_relaxed), peakReferences.load(std::memory_order_relaxed),
+                          objects.load(std::memory_order_relaxed), peakObjects.load(std::memory_order_relaxed)};
+      }
+
+      std::string_view name;
+      std::atomic<uint64_t> acquisitions{0};
+      std::atomic<size_t> references{0};
+      std::atomic<size_t> peakReferences{0};
+      std::atomic<size_t> objects{0};
+      std::atomic<size_t> peakObjects{0};
+   };
+
+   struct ObjectRecord
+   {
+      TypeRecord *type;
+      uint64_t acquisitions;
+      size_t references;
+      size_t peakReferences;
+   };
+
+   struct ShardState
+   {
+      std::unordered_map<const void *, ObjectRecord> objects;
+   };
+
+   using Shard = refcountable_detail::Shards<ShardState>::Shard;
+
+   struct Registry
+   {
+      TypeRecord &type(std::string_view name)
+      {
+         std::lock_guard<std::mutex> guard{typesLock};
+
+         std::unique_ptr<TypeRecord> &type = types[name];
+         if (!type)
+            type = std::make_unique<TypeRecord>(name);
+         return *type;
+      }
+
+      refcountable_detail::Shards<ShardState> shards;
+      std::mutex typesLock;
+      std::unordered_map<std::string_view, std::unique_ptr<TypeRecord>> types;
+      TypeRecord unregistered{"(unregistered)"};
+   };
+
+   // Never destroyed, so that objects with static storage duration can
+   // still report their destruction during exit.
+   static Registry &instance()
+   {
+      return refcountable_detail::leaked<Registry>();
+   }
+
+   static void raiseTo(std::atomic<size_t> &peak, size_t value)
+   {
+      size_t current = peak.load(std::memory_order_relaxed);
+      while (current < value && !peak.compare_exchange_weak(current, value, std::memory_order_relaxed))
+      {
+      }
+   }
+};
@@ -0,0 +1,302 @@
+#pragma once
+
+#include "RefCountableSideTable.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+
+#if !defined(REFCOUNTABLE_TRACE_CAPACITY)
+#define REFCOUNTABLE_TRACE_CAPACITY (1 << 16)
+#endif
+
+// Lifetime event tracing, fed when RefCountable.hpp is compiled with
+// REFCOUNTABLE_TRACE. Every thread appends to its own ring buffer of
+// REFCOUNTABLE_TRACE_CAPACITY events without locking; the newest events
+// of all threads can be exported as Chrome trace JSON, which Perfetto and
+// chrome://tracing both load. Buffers of exited threads are reused by new
+// threads, keeping their events until they are overwritten.
+class RefCountableTrace
+{
+public:
+   enum class Event : uint8_t
+   {
+      Construct,
+      Acquire,
+      Release,
+      Mutate,
+      Destroy
+   };
+
+   struct Record
+   {
+      uint64_t timestamp;
+      const void *object;
+      size_t references;
+      Event event;
+      uint32_t thread;
+   };
+
+   static void record(Event event, const std::atomic<size_t> &counter, size_t references)
+   {
+      Buffer *buffer = threadBuffer();
+      if (!buffer)
+      {
+         instance().dropped.fetch_add(1, std::memory_order_relaxed);
+         return;
+      }
+
+      buffer->append(timestamp(), &counter, references, event);
+   }
+
+   // Events recorded by a thread's exit-time destructors after it handed
+   // its buffer back. They are not stored.
+   static uint64_t dropped()
+   {
+      return instance().dropped.load(std::memory_order_relaxed);
+   }
+
+   // Copies out the events still held in the ring buffers, oldest first
+   // within each thread.
+   static std::vector<Record> records()
+   {
+      Registry &registry = instance();
+      std::vector<Record> records;
+
+      std::lock_guard<std::mutex> guard{registry.lock};
+      for (const std::unique_ptr<Buffer> &buffer : registry.buffers)
+         buffer->copy(records);
+
+      return records;
+   }
+
+   static void clear()
+   {
+      Registry &registry = instance();
+
+      std::lock_guard<std::mutex> guard{registry.lock};
+      for (const std::unique_ptr<Buffer> &buffer : registry.buffers)
+         buffer->tail.store(buffer->head.load(std::memory_order_acquire), std::memory_order_relaxed);
+   }
+
+   // Writes instant events on one track per thread and one reference
+   // count track per object.
+   static void writeChromeTrace(std::ostream &out)
+   {
+      const std::vector<Record> events = records();
+      const Registry &registry = instance();
+      const double ticksPerMicrosecond = calibrate();
+
+      out << "{\"traceEvents\": [";
+      bool first = true;
+      for (const Record &record : events)
+      {
+         const double microseconds = (record.timestamp - registry.startTimestamp) / ticksPerMicrosecond;
+
+         out << (first ? "\n" : ",\n") << "{\"name\": \"" << name(record.event)
+             << "\", \"ph\": \"i\", \"s\": \"t\", \"pid\": 1, \"tid\": " << record.thread
+             << ", \"ts\": " << microseconds << ", \"args\": {\"object\": \"" << record.object
+             << "\", \"references\": " << record.references << "}}";
+         first = false;
+
+         if (record.event == Event::Acquire || record.event == Event::Release)
+         {
+            out << ",\n{\"name\": \"references " << record.object << "\", \"ph\": \"C\", \"pid\": 1, \"ts\": "
+                << microseconds << ", \"args\": {\"references\": " << record.references << "}}";
+         }
+      }
+      out << "\n]}\n";
+   }
+
+private:
+   struct Buffer
+   {
+      explicit Buffer(uint32_t thread) : thread{thread} {}
+
+      void append(uint64_t timestamp, const void *object, size_t references, Event event)
+      {
+         const uint64_t index = head.load(std::memory_order_relaxed);
+         Slot &slot = slots[index % REFCOUNTABLE_TRACE_CAPACITY];
+
+         // Orders the previous head update before the slot is overwritten,
+         // for copy() to detect torn slots. Free on x86.
+         std::atomic_thread_fence(std::memory_order_release);
+
+         slot.timestamp.store(timestamp, std::memory_order_relaxed);
+         slot.object.store(reinterpret_cast<uintptr_t>(object), std::memory_order_relaxed);
+         slot.data.store(static_cast<uint64_t>(references) << 8 | static_cast<uint64_t>(event),
+                         std::memory_order_relaxed);
+
+         head.store(index + 1, std::memory_order_release);
+      }
+
+      // Events that the writer may have overwritten, or may be overwriting,
+      // while they were being copied are dropped again afterwards.
+      void copy(std::vector<Record> &records) const
+      {
+         const uint64_t end = head.load(std::memory_order_acquire);
+         const uint64_t begin = std::max(tail.load(std::memory_order_relaxed),
+                                   end > REFCOUNTABLE_TRACE_CAPACITY ? end - REFCOUNTABLE_TRACE_CAPACITY : 0);
+
+         const size_t offset = records.size();
+         for (uint64_t index = begin; index < end; ++index)
+         {
+            const Slot &slot = slots[index % REFCOUNTABLE_TRACE_CAPACITY];
+            const uint64_t data = slot.data.load(std::memory_order_relaxed);
+
+            records.push_back(Record{slot.timestamp.load(std::memory_order_relaxed),
+                                     reinterpret_cast<const void *>(slot.object.load(std::memory_order_relaxed)),
+                                     static_cast<size_t>(data >> 8), static_cast<Event>(data & 0xff), thread});
+         }
+
+         std::atomic_thread_fence(std::memory_order_acquire);
+         const uint64_t overwritten = head.load(std::memory_order_relaxed) + 1;
+         if (overwritten > REFCOUNTABLE_TRACE_CAPACITY && overwritten - REFCOUNTABLE_TRACE_CAPACITY > begin)
+         {
+            const uint64_t lost = std::min(end, overwritten - REFCOUNTABLE_TRACE_CAPACITY) - begin;
+            records.erase(records.begin() + offset, records.begin() + offset + lost);
+         }
+      }
+
+      struct Slot
+      {
+         std::atomic<uint64_t> timestamp{0};
+         std::atomic<uintptr_t> object{0};
+         std::atomic<uint64_t> data{0};
+      };
+
+      const uint32_t thread;
+      std::atomic<uint64_t> head{0};
+      std::atomic<uint64_t> tail{0};
+      Slot slots[REFCOUNTABLE_TRACE_CAPACITY];
+   };
+
+   struct Registry
+   {
+      Registry()
+          : startTimestamp{timestamp()}, startTime{std::chrono::steady_clock::now()}
+      {
+      }
+
+      // Buffers outlive their threads so that the events of finished
+      // threads can still be exported. A new thread takes over the buffer
+      // of a finished one, and its track, before a new buffer is made, so
+      // memory follows the peak number of live threads.
+      Buffer *attach()
+      {
+         std::lock_guard<std::mutex> guard{lock};
+         if (!idle.empty())
+         {
+            Buffer *buffer = idle.back();
+            idle.pop_back();
+            return buffer;
+         }
+
+         buffers.push_back(std::make_unique<Buffer>(static_cast<uint32_t>(buffers.size())));
+         return buffers.back().get();
+      }
+
+      void detach(Buffer *buffer)
+      {
+         std::lock_guard<std::mutex> guard{lock};
+         idle.push_back(buffer);
+      }
+
+      const uint64_t startTimestamp;
+      const std::chrono::steady_clock::time_point startTime;
+      std::mutex lock;
+      std::vector<std::unique_ptr<Buffer>> buffers;
+      std::vector<Buffer *> idle;
+      std::atomic<uint64_t> dropped{0};
+   };
+
+   struct ThreadExit
+   {
+      ~ThreadExit()
+      {
+         instance().detach(current);
+         current = nullptr;
+         exited = true;
+      }
+   };
+
+   // Only trivially destructible thread_locals point at the buffer, so it
+   // stays usable from other exit-time destructors until ThreadExit hands
+   // it back.
+   static Buffer *threadBuffer()
+   {
+      if (!current && !exited)
+      {
+         current = instance().attach();
+         thread_local ThreadExit exit;
+         (void)exit;
+      }
+
+      return current;
+   }
+
+   static inline thread_local Buffer *current = nullptr;
+   static inline thread_local bool exited = false;
+
+   static Registry &instance()
+   {
+      return refcountable_detail::leaked<Registry>();
+   }
+
+   static uint64_t timestamp()
+   {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+      return __rdtsc();
+#elif defined(__aarch64__)
+      uint64_t ticks;
+      asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+      return ticks;
+#else
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                 std::chrono::steady_clock::now().time_since_epoch())
+          .count();
+#endif
+   }
+
+   static double calibrate()
+   {
+      const Registry &registry = instance();
+
+      const uint64_t ticks = timestamp() - registry.startTimestamp;
+      const double microseconds =
+          std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - registry.startTime).count();
+
+      return microseconds > 0 && ticks > 0 ? ticks / microseconds : 1.0;
+   }
+
+   static const char *name(Event event)
+   {
+      switch (event)
+      {
+      case Event::Construct:
+         return "construct";
+      case Event::Acquire:
+         return "acquire";
+      case Event::Release:
+         return "release";
+      case Event::Mutate:
+         return "mutate";
+      case Event::Destroy:
+         return "destroy";
+      }
+      return "";
+   }
+};
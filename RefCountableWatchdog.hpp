@@ -0,0 +1,116 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "RefCountableHolders.hpp"
+
+// Background thread that reports RefCounted handles held for longer than
+// a lease. It needs the holder table, so it only sees handles created
+// with REFCOUNTABLE_HOLDERS. While it runs, it also drives the coarse
+// clock the holders are stamped with. Each stuck handle is reported once.
+class RefCountableWatchdog
+{
+public:
+   struct Stuck
+   {
+      const void *object;
+      RefCountableSourceLocation location;
+      std::thread::id thread;
+      std::chrono::steady_clock::duration age;
+   };
+
+   using Report = std::function<void(const Stuck &)>;
+
+   explicit RefCountableWatchdog(std::chrono::steady_clock::duration lease, Report report = print)
+       : lease{lease}, report{std::move(report)}, thread{[this]
+                                                         { run(); }}
+   {
+   }
+
+   ~RefCountableWatchdog()
+   {
+      {
+         std::lock_guard<std::mutex> guard{lock};
+         stopping = true;
+      }
+      wake.notify_one();
+      thread.join();
+
+      RefCountableHolders::tick({});
+   }
+
+   RefCountableWatchdog(const RefCountableWatchdog &) = delete;
+   RefCountableWatchdog &operator=(const RefCountableWatchdog &) = delete;
+
+   static void print(const Stuck &stuck)
+   {
+      const auto age = std::chrono::duration_cast<std::chrono::milliseconds>(stuck.age);
+      std::cerr << "object " << stuck.object << " held for " << age.count() << " ms by "
+                << stuck.location.file_name() << ':' << stuck.location.line() << " in "
+                << stuck.location.function_name() << " (thread " << stuck.thread << ")\n";
+   }
+
+private:
+   void run()
+   {
+      using namespace std::chrono;
+
+      const auto tick = std::clamp<steady_clock::duration>(lease / 8, milliseconds{1}, milliseconds{100});
+      auto nextScan = steady_clock::now();
+
+      std::unique_lock<std::mutex> guard{lock};
+      while (!wake.wait_for(guard, tick, [this]
+                            { return stopping; }))
+      {
+         const auto now = steady_clock::now();
+         RefCountableHolders::tick(now);
+
+         if (now < nextScan)
+            continue;
+
+         nextScan = now + lease / 4;
+         scan(now);
+      }
+   }
+
+   void scan(std::chrono::steady_clock::time_point now)
+   {
+      std::vector<Stuck> fresh;
+      std::unordered_map<const RefCountableHolders::Holder *, std::chrono::steady_clock::time_point> stuck;
+
+      RefCountableHolders::forEach([&](const RefCountableHolders::Holder *head)
+                                   {
+         for (const RefCountableHolders::Holder *holder = head; holder; holder = holder->next)
+         {
+            if (now - holder->since < lease)
+               continue;
+
+            stuck.emplace(holder, holder->since);
+
+            const auto found = reported.find(holder);
+            if (found == reported.end() || found->second != holder->since)
+               fresh.push_back(Stuck{holder->object, holder->location, holder->thread, now - holder->since});
+         } });
+
+      reported = std::move(stuck);
+
+      for (const Stuck &handle : fresh)
+         report(handle);
+   }
+
+   const std::chrono::steady_clock::duration lease;
+   const Report report;
+   std::unordered_map<const RefCountableHolders::Holder *, std::chrono::steady_clock::time_point> reported;
+   std::mutex lock;
+   std::condition_variable wake;
+   bool stopping = false;
+   std::thread thread;
+};
@@ -0,0 +1,153 @@
+#pragma once
+
+#include "RefCountable.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+#if defined(_MSC_VER) && !defined(__clang__) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#endif
+
+template <typename E>
+const void *prefetchTarget(const E &element)
+{
+   return std::addressof(element.get());
+}
+
+template <typename T>
+const void *prefetchTarget(const RefCountedOpt<T> &element)
+{
+   return element ? std::addressof(element.get()) : nullptr;
+}
+
+inline void prefetchAddress(const void *address)
+{
+#if defined(__GNUC__) || defined(__clang__)
+   __builtin_prefetch(address);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+   _mm_prefetch(static_cast<const char *>(address), _MM_HINT_T0);
+#else
+   (void)address;
+#endif
+}
+
+template <typename Iterator>
+class PrefetchIterator
+{
+public:
+   using iterator_category = std::forward_iterator_tag;
+   using value_type = typename std::iterator_traits<Iterator>::value_type;
+   using difference_type = typename std::iterator_traits<Iterator>::difference_type;
+   using pointer = typename std::iterator_traits<Iterator>::pointer;
+   using reference = typename std::iterator_traits<Iterator>::reference;
+
+   PrefetchIterator(Iterator current, Iterator ahead, Iterator end)
+       : current{current}, ahead{ahead}, end{end}
+   {
+   }
+
+   reference operator*() const { return *current; }
+   Iterator operator->() const { return current; }
+
+   PrefetchIterator &operator++()
+   {
+      ++current;
+
+      if (ahead != end)
+      {
+         if (const void *target = prefetchTarget(*ahead))
+            prefetchAddress(target);
+         ++ahead;
+      }
+
+      return *this;
+   }
+
+   PrefetchIterator operator++(int)
+   {
+      PrefetchIterator copy{*this};
+      ++*this;
+      return copy;
+   }
+
+   bool operator==(const PrefetchIterator &rhs) const { return current == rhs.current; }
+   bool operator!=(const PrefetchIterator &rhs) const { return current != rhs.current; }
+
+private:
+   Iterator current;
+   Iterator ahead;
+   Iterator end;
+};
+
+template <typename Iterator>
+class PrefetchRange
+{
+public:
+   PrefetchRange(Iterator first, Iterator last, size_t distance)
+       : first{first}, last{last}, distance{distance}
+   {
+   }
+
+   PrefetchIterator<Iterator> begin() const
+   {
+      Iterator ahead = first;
+
+      for (size_t i = 0; i < distance && ahead != last; ++i, ++ahead)
+      {
+         if (const void *target = prefetchTarget(*ahead))
+            prefetchAddress(target);
+      }
+
+      return PrefetchIterator<Iterator>{first, ahead, last};
+   }
+
+   PrefetchIterator<Iterator> end() const
+   {
+      return PrefetchIterator<Iterator>{last, last, last};
+   }
+
+private:
+   Iterator first;
+   Iterator last;
+   size_t distance;
+};
+
+template <typename Range>
+auto prefetched(Range &range, size_t distance = 8)
+{
+   using Iterator = decltype(std::begin(range));
+
+   return PrefetchRange<Iterator>{std::begin(range), std::end(range), distance};
+}
+
+template <typename Container>
+void sortByTarget(Container &container)
+{
+   using E = std::remove_reference_t<decltype(*container.data())>;
+
+   static_assert(IsTriviallyRelocatable<E>::value, "sortByTarget requires a trivially relocatable element type");
+
+   const size_t count = container.size();
+   if (count < 2)
+      return;
+
+   E *elements = container.data();
+
+   std::vector<const E *> order(count);
+   for (size_t i = 0; i < count; ++i)
+      order[i] = elements + i;
+
+   std::sort(order.begin(), order.end(), [](const E *lhs, const E *rhs)
+             { return std::less<const void *>{}(prefetchTarget(*lhs), prefetchTarget(*rhs)); });
+
+   std::unique_ptr<unsigned char[]> buffer{new unsigned char[count * sizeof(E)]};
+   for (size_t i = 0; i < count; ++i)
+      std::memcpy(buffer.get() + i * sizeof(E), static_cast<const void *>(order[i]), sizeof(E));
+
+   std::memcpy(static_cast<void *>(elements), buffer.get(), count * sizeof(E));
+}
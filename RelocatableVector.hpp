@@ -0,0 +1,179 @@
+#pragma once
+
+#include "RefCountable.hpp"
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+template <typename T>
+void relocate(T *first, T *last, T *dest) noexcept
+{
+   static_assert(IsTriviallyRelocatable<T>::value, "relocate requires a trivially relocatable type");
+
+   std::memmove(static_cast<void *>(dest), static_cast<const void *>(first), (last - first) * sizeof(T));
+}
+
+template <typename T>
+class RelocatableVector
+{
+   static_assert(IsTriviallyRelocatable<T>::value, "RelocatableVector requires a trivially relocatable type");
+   static_assert(alignof(T) <= alignof(std::max_align_t), "RelocatableVector does not support over-aligned types");
+
+public:
+   using value_type = T;
+   using size_type = size_t;
+   using iterator = T *;
+   using const_iterator = const T *;
+
+   RelocatableVector() noexcept : first{nullptr}, last{nullptr}, capacityEnd{nullptr} {}
+
+   RelocatableVector(const RelocatableVector &rhs) : RelocatableVector{}
+   {
+      reserve(rhs.size());
+
+      for (const T &item : rhs)
+      {
+         new (last) T(item);
+         ++last;
+      }
+   }
+
+   RelocatableVector(RelocatableVector &&rhs) noexcept
+       : first{rhs.first}, last{rhs.last}, capacityEnd{rhs.capacityEnd}
+   {
+      rhs.first = rhs.last = rhs.capacityEnd = nullptr;
+   }
+
+   ~RelocatableVector()
+   {
+      clear();
+      std::free(static_cast<void *>(first));
+   }
+
+   RelocatableVector &operator=(const RelocatableVector &rhs)
+   {
+      if (this != &rhs)
+      {
+         RelocatableVector copy{rhs};
+         swap(copy);
+      }
+      return *this;
+   }
+
+   RelocatableVector &operator=(RelocatableVector &&rhs) noexcept
+   {
+      RelocatableVector moved{std::move(rhs)};
+      swap(moved);
+      return *this;
+   }
+
+   void swap(RelocatableVector &rhs) noexcept
+   {
+      std::swap(first, rhs.first);
+      std::swap(last, rhs.last);
+      std::swap(capacityEnd, rhs.capacityEnd);
+   }
+
+   T *begin() noexcept { return first; }
+   T *end() noexcept { return last; }
+   const T *begin() const noexcept { return first; }
+   const T *end() const noexcept { return last; }
+
+   T *data() noexcept { return first; }
+   const T *data() const noexcept { return first; }
+
+   size_t size() const noexcept { return last - first; }
+   size_t capacity() const noexcept { return capacityEnd - first; }
+   bool empty() const noexcept { return first == last; }
+
+   T &operator[](size_t index) { return first[index]; }
+   const T &operator[](size_t index) const { return first[index]; }
+
+   T &back() { return last[-1]; }
+   const T &back() const { return last[-1]; }
+
+   void reserve(size_t newCapacity)
+   {
+      if (newCapacity <= capacity())
+         return;
+
+      const size_t count = size();
+      void *memory = std::realloc(static_cast<void *>(first), newCapacity * sizeof(T));
+      if (!memory)
+         throw std::bad_alloc{};
+
+      first = static_cast<T *>(memory);
+      last = first + count;
+      capacityEnd = first + newCapacity;
+   }
+
+   template <typename... Args>
+   T &emplace_back(Args &&...args)
+   {
+      if (last == capacityEnd)
+      {
+         alignas(T) unsigned char buffer[sizeof(T)];
+         T *item = new (buffer) T(std::forward<Args>(args)...);
+
+         try
+         {
+            grow();
+         }
+         catch (...)
+         {
+            item->~T();
+            throw;
+         }
+
+         relocate(item, item + 1, last);
+         return *last++;
+      }
+
+      T *item = new (last) T(std::forward<Args>(args)...);
+      ++last;
+      return *item;
+   }
+
+   void push_back(const T &item) { emplace_back(item); }
+   void push_back(T &&item) { emplace_back(std::move(item)); }
+
+   void pop_back()
+   {
+      (--last)->~T();
+   }
+
+   T *erase(T *pos)
+   {
+      return erase(pos, pos + 1);
+   }
+
+   T *erase(T *from, T *to)
+   {
+      for (T *item = from; item != to; ++item)
+         item->~T();
+
+      relocate(to, last, from);
+      last -= to - from;
+
+      return from;
+   }
+
+   void clear() noexcept
+   {
+      while (last != first)
+         (--last)->~T();
+   }
+
+private:
+   void grow()
+   {
+      const size_t count = capacity();
+      reserve(count ? count * 2 : 4);
+   }
+
+   T *first;
+   T *last;
+   T *capacityEnd;
+};
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Reusable spinning barrier; every wait() returns once count threads
+// have reached it.
+class Barrier
+{
+public:
+   explicit Barrier(unsigned count) : count{count} {}
+
+   void wait()
+   {
+      const unsigned current = generation.load(std::memory_order_acquire);
+      if (arrived.fetch_add(1, std::memory_order_acq_rel) + 1 == count)
+      {
+         arrived.store(0, std::memory_order_relaxed);
+         generation.store(current + 1, std::memory_order_release);
+         return;
+      }
+
+      while (generation.load(std::memory_order_acquire) == current)
+         std::this_thread::yield();
+   }
+
+private:
+   const unsigned count;
+   std::atomic<unsigned> arrived{0};
+   std::atomic<unsigned> generation{0};
+};
+
+// Splits a comma separated option value and parses each item.
+template <typename T, typename Parse>
+std::vector<T> parseList(const char *text, Parse parse)
+{
+   std::vector<T> items;
+   std::string list{text};
+
+   for (size_t begin = 0; begin <= list.size();)
+   {
+      size_t end = list.find(',', begin);
+      if (end == std::string::npos)
+         end = list.size();
+
+      items.push_back(parse(list.substr(begin, end - begin)));
+      begin = end + 1;
+   }
+
+   return items;
+}
+
+inline std::vector<std::string> parseList(const char *text)
+{
+   return parseList<std::string>(text, [](const std::string &item) { return item; });
+}
+
+// Prints "usage: PROGRAM OPTIONS" and exits with status 2.
+[[noreturn]] inline void usage(const char *program, const char *options)
+{
+   std::fprintf(stderr, "usage: %s %s", program, options);
+   std::exit(2);
+}
@@ -0,0 +1,218 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#if defined(__linux__)
+#include <cstdio>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+inline int openPerfEvent(uint32_t type, uint64_t config, bool inherit, int groupLeader = -1)
+{
+#if defined(__linux__)
+   perf_event_attr attr;
+   std::memset(&attr, 0, sizeof(attr));
+   attr.size = sizeof(attr);
+   attr.type = type;
+   attr.config = config;
+   attr.disabled = groupLeader < 0 ? 1 : 0;
+   attr.inherit = inherit ? 1 : 0;
+   attr.exclude_kernel = 1;
+   attr.exclude_hv = 1;
+   attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+   return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, groupLeader, 0));
+#else
+   (void)type;
+   (void)config;
+   (void)inherit;
+   (void)groupLeader;
+   return -1;
+#endif
+}
+
+// Reads an event opened by openPerfEvent, scaled for multiplexing, or -1
+// when the event is not counting.
+inline int64_t readPerfEvent(int descriptor)
+{
+#if defined(__linux__)
+   uint64_t values[3] = {};
+   if (descriptor >= 0 && ::read(descriptor, values, sizeof(values)) == sizeof(values) && values[2] != 0)
+      return static_cast<int64_t>(static_cast<double>(values[0]) * values[1] / values[2]);
+#else
+   (void)descriptor;
+#endif
+   return -1;
+}
+
+inline void closePerfEvent(int descriptor)
+{
+#if defined(__linux__)
+   if (descriptor >= 0)
+      close(descriptor);
+#else
+   (void)descriptor;
+#endif
+}
+
+// A hardware counter opened through perf_event_open. When the kernel or
+// the sandbox refuses the event, valid() is false and read() returns -1.
+class PerfCounter
+{
+public:
+   PerfCounter(uint32_t type, uint64_t config, bool inherit = true)
+       : descriptor{openPerfEvent(type, config, inherit)}
+   {
+   }
+
+   PerfCounter(const PerfCounter &) = delete;
+   PerfCounter &operator=(const PerfCounter &) = delete;
+
+   ~PerfCounter()
+   {
+      closePerfEvent(descriptor);
+   }
+
+   bool valid() const { return descriptor >= 0; }
+
+   void start()
+   {
+#if defined(__linux__)
+      if (descriptor >= 0)
+      {
+         ioctl(descriptor, PERF_EVENT_IOC_RESET, 0);
+         ioctl(descriptor, PERF_EVENT_IOC_ENABLE, 0);
+      }
+#endif
+   }
+
+   void stop()
+   {
+#if defined(__linux__)
+      if (descriptor >= 0)
+         ioctl(descriptor, PERF_EVENT_IOC_DISABLE, 0);
+#endif
+   }
+
+   int64_t read() const
+   {
+      return readPerfEvent(descriptor);
+   }
+
+private:
+   int descriptor;
+};
+
+struct PerfEvent
+{
+   const char *name;
+   uint32_t type;
+   uint64_t config;
+};
+
+constexpr uint64_t perfCacheEvent(uint64_t cache, uint64_t operation, uint64_t result)
+{
+   return cache | (operation << 8) | (result << 16);
+}
+
+// HITM loads are a model specific raw event. The default is the Intel
+// Skylake and later MEM_LOAD_L3_HIT_RETIRED.XSNP_HITM encoding, used only
+// on Intel CPUs; other CPUs need an explicit raw config.
+inline int64_t defaultHitmConfig()
+{
+#if defined(__linux__)
+   bool intel = false;
+   if (FILE *cpuinfo = std::fopen("/proc/cpuinfo", "r"))
+   {
+      char line[256];
+      while (!intel && std::fgets(line, sizeof(line), cpuinfo))
+         intel = std::strncmp(line, "vendor_id", 9) == 0 && std::strstr(line, "GenuineIntel");
+      std::fclose(cpuinfo);
+   }
+   if (intel)
+      return 0x04d2;
+#endif
+   return -1;
+}
+
+inline std::vector<PerfEvent> defaultPerfEvents(int64_t hitmConfig)
+{
+#if defined(__linux__)
+   std::vector<PerfEvent> events{
+       {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+       {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+       {"l1d_misses", PERF_TYPE_HW_CACHE,
+        perfCacheEvent(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+       {"llc_misses", PERF_TYPE_HW_CACHE,
+        perfCacheEvent(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+   };
+
+   if (hitmConfig >= 0)
+      events.push_back({"hitm", PERF_TYPE_RAW, static_cast<uint64_t>(hitmConfig)});
+
+   return events;
+#else
+   (void)hitmConfig;
+   return {};
+#endif
+}
+
+// A set of counters for the calling thread, switched on and off together
+// through the first event that could be opened. Events that cannot be
+// opened read as -1.
+class PerfCounterGroup
+{
+public:
+   explicit PerfCounterGroup(const std::vector<PerfEvent> &events)
+   {
+      for (const PerfEvent &event : events)
+      {
+         const int descriptor = openPerfEvent(event.type, event.config, false, leader);
+         if (leader < 0)
+            leader = descriptor;
+         descriptors.push_back(descriptor);
+      }
+   }
+
+   PerfCounterGroup(const PerfCounterGroup &) = delete;
+   PerfCounterGroup &operator=(const PerfCounterGroup &) = delete;
+
+   ~PerfCounterGroup()
+   {
+      for (int descriptor : descriptors)
+         closePerfEvent(descriptor);
+   }
+
+   void enable()
+   {
+#if defined(__linux__)
+      if (leader >= 0)
+         ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+   }
+
+   void disable()
+   {
+#if defined(__linux__)
+      if (leader >= 0)
+         ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+#endif
+   }
+
+   std::vector<int64_t> read() const
+   {
+      std::vector<int64_t> values;
+      for (int descriptor : descriptors)
+         values.push_back(readPerfEvent(descriptor));
+      return values;
+   }
+
+private:
+   std::vector<int> descriptors;
+   int leader = -1;
+};
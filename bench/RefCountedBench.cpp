@@ -0,0 +1,510 @@
+// Scalability micro-benchmarks for RefCounted operations.
+//
+//    g++ -std=c++17 -O2 -pthread -I.. RefCountedBench.cpp -o RefCountedBench
+//    ./RefCountedBench --threads=1,2,4,8 --format=json > results.json
+//    ./RefCountedBench --perf --sharing=hot,adjacent
+//
+// With --perf every worker counts cycles, instructions, L1D and LLC load
+// misses and, where the CPU has an event for it, HITM loads while inside
+// the timed part of each batch, and the totals are reported per operation.
+
+#include "RefCountable.hpp"
+#include "PerfCounters.hpp"
+#include "BenchCommon.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <optional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace
+{
+   constexpr size_t batchSize = 64;
+   constexpr size_t streamSize = 1 << 14;
+
+   enum class Operation
+   {
+      Construct,
+      Copy,
+      Destroy,
+      Assign
+   };
+
+   enum class Sharing
+   {
+      Private,
+      Hot,
+      Zipf,
+      Adjacent
+   };
+
+   enum class Format
+   {
+      Csv,
+      Json
+   };
+
+   const char *name(Operation operation)
+   {
+      switch (operation)
+      {
+      case Operation::Construct:
+         return "construct";
+      case Operation::Copy:
+         return "copy";
+      case Operation::Destroy:
+         return "destroy";
+      case Operation::Assign:
+         return "assign";
+      }
+      return "";
+   }
+
+   const char *name(Sharing sharing)
+   {
+      switch (sharing)
+      {
+      case Sharing::Private:
+         return "private";
+      case Sharing::Hot:
+         return "hot";
+      case Sharing::Zipf:
+         return "zipf";
+      case Sharing::Adjacent:
+         return "adjacent";
+      }
+      return "";
+   }
+
+   struct Config
+   {
+      std::vector<unsigned> threads;
+      std::vector<Operation> operations{Operation::Construct, Operation::Copy, Operation::Destroy, Operation::Assign};
+      std::vector<Sharing> sharings{Sharing::Private, Sharing::Hot, Sharing::Zipf, Sharing::Adjacent};
+      size_t operationsPerThread = 1 << 20;
+      size_t objects = 1024;
+      double zipfSkew = 0.99;
+      bool pin = true;
+      bool perf = false;
+      int64_t hitmConfig = -2;
+      std::vector<PerfEvent> events;
+      Format format = Format::Csv;
+   };
+
+   struct Result
+   {
+      Operation operation;
+      Sharing sharing;
+      unsigned threads;
+      size_t operations;
+      double seconds;
+      double throughput;
+      double p50;
+      double p90;
+      double p99;
+      double p999;
+      double max;
+      std::vector<double> eventsPerOperation;
+   };
+
+   struct alignas(64) PaddedObject
+   {
+      RefCountable<int> object{0};
+   };
+
+   // Private and Zipf targets are padded to a cache line each, Adjacent
+   // targets are packed so that neighbouring threads share lines.
+   struct Objects
+   {
+      explicit Objects(size_t count, unsigned threads)
+          : padded{new PaddedObject[std::max<size_t>(count, threads)]},
+            packed{static_cast<RefCountable<int> *>(::operator new(sizeof(RefCountable<int>) * threads))},
+            threads{threads}
+      {
+         for (unsigned i = 0; i < threads; ++i)
+            new (packed + i) RefCountable<int>{0};
+      }
+
+      ~Objects()
+      {
+         for (unsigned i = 0; i < threads; ++i)
+            packed[i].~RefCountable();
+         ::operator delete(packed);
+      }
+
+      std::unique_ptr<PaddedObject[]> padded;
+      RefCountable<int> *packed;
+      unsigned threads;
+   };
+
+   std::vector<uint32_t> makeStream(const Config &config, Sharing sharing, unsigned thread)
+   {
+      std::vector<uint32_t> stream(streamSize);
+
+      switch (sharing)
+      {
+      case Sharing::Private:
+      case Sharing::Adjacent:
+         std::fill(stream.begin(), stream.end(), thread);
+         break;
+      case Sharing::Hot:
+         std::fill(stream.begin(), stream.end(), 0);
+         break;
+      case Sharing::Zipf:
+      {
+         std::vector<double> cdf(config.objects);
+         double sum = 0;
+         for (size_t i = 0; i < config.objects; ++i)
+            cdf[i] = sum += 1.0 / std::pow(static_cast<double>(i + 1), config.zipfSkew);
+
+         std::mt19937_64 random{0x9e3779b97f4a7c15ull ^ thread};
+         std::uniform_real_distribution<double> uniform{0, sum};
+         for (uint32_t &index : stream)
+            index = static_cast<uint32_t>(std::lower_bound(cdf.begin(), cdf.end(), uniform(random)) - cdf.begin());
+         break;
+      }
+      }
+
+      return stream;
+   }
+
+   void pinThread(unsigned thread)
+   {
+#if defined(__linux__)
+      const unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(thread % cpus, &set);
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+      (void)thread;
+#endif
+   }
+
+   using Clock = std::chrono::steady_clock;
+
+   void runThread(const Config &config, Operation operation, Sharing sharing, Objects &objects,
+                  unsigned thread, Barrier &barrier, std::vector<double> &samples, std::vector<int64_t> &events,
+                  Clock::time_point &started, Clock::time_point &finished)
+   {
+      if (config.pin)
+         pinThread(thread);
+
+      std::optional<PerfCounterGroup> counters;
+      if (config.perf)
+         counters.emplace(config.events);
+
+      auto startTimed = [&]
+      {
+         if (counters)
+            counters->enable();
+         return Clock::now();
+      };
+
+      auto stopTimed = [&]
+      {
+         const Clock::time_point now = Clock::now();
+         if (counters)
+            counters->disable();
+         return now;
+      };
+
+      const std::vector<uint32_t> stream = makeStream(config, sharing, thread);
+      auto target = [&](size_t i) -> RefCountable<int> &
+      {
+         const uint32_t index = stream[i % streamSize];
+         return sharing == Sharing::Adjacent ? objects.packed[index] : objects.padded[index].object;
+      };
+
+      alignas(RefCounted<int>) unsigned char storage[batchSize * sizeof(RefCounted<int>)];
+      RefCounted<int> *handles = reinterpret_cast<RefCounted<int> *>(storage);
+
+      RefCounted<int> source{target(0)};
+      RefCounted<int> assigned{target(1)};
+
+      const size_t batches = config.operationsPerThread / batchSize;
+      samples.reserve(batches);
+
+      barrier.wait();
+      started = Clock::now();
+
+      for (size_t batch = 0, i = 0; batch < batches; ++batch)
+      {
+         Clock::time_point begin;
+         Clock::time_point end;
+
+         switch (operation)
+         {
+         case Operation::Construct:
+            begin = startTimed();
+            for (size_t j = 0; j < batchSize; ++j)
+               new (handles + j) RefCounted<int>{target(i++)};
+            end = stopTimed();
+            for (size_t j = 0; j < batchSize; ++j)
+               handles[j].~RefCounted();
+            break;
+         case Operation::Copy:
+            begin = startTimed();
+            for (size_t j = 0; j < batchSize; ++j)
+               new (handles + j) RefCounted<int>{source};
+            end = stopTimed();
+            for (size_t j = 0; j < batchSize; ++j)
+               handles[j].~RefCounted();
+            break;
+         case Operation::Destroy:
+            for (size_t j = 0; j < batchSize; ++j)
+               new (handles + j) RefCounted<int>{target(i++)};
+            begin = startTimed();
+            for (size_t j = 0; j < batchSize; ++j)
+               handles[j].~RefCounted();
+            end = stopTimed();
+            break;
+         case Operation::Assign:
+         {
+            RefCounted<int> next{target(i++)};
+            begin = startTimed();
+            for (size_t j = 0; j < batchSize; ++j)
+               assigned = (j & 1) ? source : next;
+            end = stopTimed();
+            break;
+         }
+         }
+
+         samples.push_back(std::chrono::duration<double, std::nano>(end - begin).count() / batchSize);
+      }
+
+      finished = Clock::now();
+
+      if (counters)
+         events = counters->read();
+   }
+
+   double percentile(const std::vector<double> &sorted, double fraction)
+   {
+      if (sorted.empty())
+         return 0;
+
+      return sorted[std::min(sorted.size() - 1, static_cast<size_t>(fraction * sorted.size()))];
+   }
+
+   Result run(const Config &config, Operation operation, Sharing sharing, unsigned threads)
+   {
+      Objects objects{config.objects, threads};
+      Barrier barrier{threads};
+
+      std::vector<std::vector<double>> samples(threads);
+      std::vector<std::vector<int64_t>> events(threads);
+      std::vector<Clock::time_point> started(threads);
+      std::vector<Clock::time_point> finished(threads);
+      std::vector<std::thread> workers;
+
+      for (unsigned thread = 0; thread < threads; ++thread)
+      {
+         workers.emplace_back(runThread, std::cref(config), operation, sharing, std::ref(objects),
+                              thread, std::ref(barrier), std::ref(samples[thread]), std::ref(events[thread]),
+                              std::ref(started[thread]), std::ref(finished[thread]));
+      }
+
+      for (std::thread &worker : workers)
+         worker.join();
+
+      // Throughput only counts the timed part of each batch, so setup and
+      // teardown of the handles do not dilute construct and destroy rates.
+      double throughput = 0;
+      std::vector<double> merged;
+      for (const std::vector<double> &thread : samples)
+      {
+         double nanoseconds = 0;
+         for (double sample : thread)
+            nanoseconds += sample;
+         if (nanoseconds > 0)
+            throughput += thread.size() / nanoseconds * 1e9;
+
+         merged.insert(merged.end(), thread.begin(), thread.end());
+      }
+      std::sort(merged.begin(), merged.end());
+
+      const Clock::time_point start = *std::min_element(started.begin(), started.end());
+      const Clock::time_point end = *std::max_element(finished.begin(), finished.end());
+
+      Result result;
+      result.operation = operation;
+      result.sharing = sharing;
+      result.threads = threads;
+      result.operations = merged.size() * batchSize;
+      result.seconds = std::chrono::duration<double>(end - start).count();
+      result.throughput = throughput;
+      result.p50 = percentile(merged, 0.50);
+      result.p90 = percentile(merged, 0.90);
+      result.p99 = percentile(merged, 0.99);
+      result.p999 = percentile(merged, 0.999);
+      result.max = merged.empty() ? 0 : merged.back();
+
+      for (size_t event = 0; event < config.events.size(); ++event)
+      {
+         int64_t total = 0;
+         for (const std::vector<int64_t> &thread : events)
+         {
+            if (event >= thread.size() || thread[event] < 0)
+            {
+               total = -1;
+               break;
+            }
+            total += thread[event];
+         }
+
+         result.eventsPerOperation.push_back(total < 0 || result.operations == 0
+                                                 ? -1.0
+                                                 : static_cast<double>(total) / result.operations);
+      }
+
+      return result;
+   }
+
+   void print(const std::vector<Result> &results, const Config &config)
+   {
+      if (config.format == Format::Csv)
+      {
+         std::printf("operation,sharing,threads,operations,seconds,mops_per_second,p50_ns,p90_ns,p99_ns,p999_ns,max_ns");
+         for (const PerfEvent &event : config.events)
+            std::printf(",%s_per_op", event.name);
+         std::printf("\n");
+
+         for (const Result &result : results)
+         {
+            std::printf("%s,%s,%u,%zu,%.6f,%.3f,%.2f,%.2f,%.2f,%.2f,%.2f",
+                        name(result.operation), name(result.sharing), result.threads, result.operations,
+                        result.seconds, result.throughput / 1e6,
+                        result.p50, result.p90, result.p99, result.p999, result.max);
+            for (double value : result.eventsPerOperation)
+               std::printf(",%.4f", value);
+            std::printf("\n");
+         }
+         return;
+      }
+
+      std::printf("[\n");
+      for (size_t i = 0; i < results.size(); ++i)
+      {
+         const Result &result = results[i];
+         std::printf("  {\"operation\": \"%s\", \"sharing\": \"%s\", \"threads\": %u, \"operations\": %zu, "
+                     "\"seconds\": %.6f, \"mops_per_second\": %.3f, \"p50_ns\": %.2f, \"p90_ns\": %.2f, "
+                     "\"p99_ns\": %.2f, \"p999_ns\": %.2f, \"max_ns\": %.2f",
+                     name(result.operation), name(result.sharing), result.threads, result.operations,
+                     result.seconds, result.throughput / 1e6,
+                     result.p50, result.p90, result.p99, result.p999, result.max);
+         for (size_t event = 0; event < config.events.size(); ++event)
+            std::printf(", \"%s_per_op\": %.4f", config.events[event].name, result.eventsPerOperation[event]);
+         std::printf("}%s\n", i + 1 == results.size() ? "" : ",");
+      }
+      std::printf("]\n");
+   }
+
+   const char *const usageOptions = "[--threads=1,2,4] [--ops=N] [--objects=N] [--zipf=S] [--no-pin]\n"
+                                    "          [--perf] [--hitm=RAWCONFIG|off]\n"
+                                    "          [--operations=construct,copy,destroy,assign]\n"
+                                    "          [--sharing=private,hot,zipf,adjacent] [--format=csv|json]\n";
+
+   Config parseArguments(int argc, char **argv)
+   {
+      Config config;
+
+      for (int i = 1; i < argc; ++i)
+      {
+         const char *argument = argv[i];
+         auto option = [&](const char *prefix) -> const char *
+         {
+            const size_t length = std::strlen(prefix);
+            return std::strncmp(argument, prefix, length) == 0 ? argument + length : nullptr;
+         };
+
+         if (const char *value = option("--threads="))
+         {
+            config.threads = parseList<unsigned>(value, [](const std::string &item)
+                                                 { return static_cast<unsigned>(std::stoul(item)); });
+         }
+         else if (const char *value = option("--ops="))
+            config.operationsPerThread = std::stoull(value);
+         else if (const char *value = option("--objects="))
+            config.objects = std::max<size_t>(2, std::stoull(value));
+         else if (const char *value = option("--zipf="))
+            config.zipfSkew = std::stod(value);
+         else if (std::strcmp(argument, "--no-pin") == 0)
+            config.pin = false;
+         else if (std::strcmp(argument, "--perf") == 0)
+            config.perf = true;
+         else if (const char *value = option("--hitm="))
+            config.hitmConfig = std::strcmp(value, "off") == 0 ? -1 : static_cast<int64_t>(std::stoull(value, nullptr, 0));
+         else if (const char *value = option("--format="))
+         {
+            if (std::strcmp(value, "csv") == 0)
+               config.format = Format::Csv;
+            else if (std::strcmp(value, "json") == 0)
+               config.format = Format::Json;
+            else
+               usage(argv[0], usageOptions);
+         }
+         else if (const char *value = option("--operations="))
+         {
+            config.operations = parseList<Operation>(value, [&](const std::string &item)
+                                                     {
+               for (Operation operation : {Operation::Construct, Operation::Copy, Operation::Destroy, Operation::Assign})
+                  if (item == name(operation))
+                     return operation;
+               usage(argv[0], usageOptions); });
+         }
+         else if (const char *value = option("--sharing="))
+         {
+            config.sharings = parseList<Sharing>(value, [&](const std::string &item)
+                                                 {
+               for (Sharing sharing : {Sharing::Private, Sharing::Hot, Sharing::Zipf, Sharing::Adjacent})
+                  if (item == name(sharing))
+                     return sharing;
+               usage(argv[0], usageOptions); });
+         }
+         else
+            usage(argv[0], usageOptions);
+      }
+
+      if (config.perf)
+         config.events = defaultPerfEvents(config.hitmConfig == -2 ? defaultHitmConfig() : config.hitmConfig);
+
+      if (config.threads.empty())
+      {
+         const unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+         for (unsigned threads = 1; threads < cpus; threads *= 2)
+            config.threads.push_back(threads);
+         config.threads.push_back(cpus);
+      }
+
+      return config;
+   }
+}
+
+int main(int argc, char **argv)
+{
+   const Config config = parseArguments(argc, argv);
+
+   std::vector<Result> results;
+   for (Operation operation : config.operations)
+      for (Sharing sharing : config.sharings)
+         for (unsigned threads : config.threads)
+            results.push_back(run(config, operation, sharing, threads));
+
+   print(results, config);
+}
@@ -0,0 +1,798 @@
+// Randomised concurrency stress harness for RefCountable, RefCountableBase
+// and their handles.
+//
+//    g++ -std=c++17 -O2 -pthread -I.. RefCountedStress.cpp -o RefCountedStress
+//    ./RefCountedStress --threads=2,8 --runs=32
+//    ./RefCountedStress --seed=1234 --threads=8      # replay a failure
+//
+// Every worker draws its operations (acquire, copy, assign, move, release,
+// hand-off to another thread, destroy and recreate) from a generator seeded
+// with the run seed and the worker index, and at seeded points yields or
+// spins to perturb the interleaving. A model of which object every handle
+// should refer to is checked after each operation, and at the end of every
+// round the objects that should be unreferenced must drain immediately.
+// A failed check, or the library terminating on a destroyed-while-referenced
+// object, prints the arguments that replay the same decisions. The thread
+// interleaving itself is perturbed rather than controlled, so a replay
+// repeats the schedule of operations, not the exact timing.
+
+#include "RefCountable.hpp"
+#include "BenchCommon.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+   constexpr size_t none = SIZE_MAX;
+
+   // Handles released while worker threads and the process exit, after
+   // thread_local and static instrumentation state may have been torn
+   // down. Build with -DREFCOUNTABLE_HOT_OBJECTS (period 1), TRACE or
+   // RECORD under the sanitizers to check those modes survive it.
+   RefCountable<int> exitObject{0};
+   RefCounted<int> exitHandle{exitObject};
+
+   struct Config
+   {
+      std::vector<unsigned> threads;
+      uint64_t seed = 1;
+      size_t runs = 8;
+      size_t rounds = 16;
+      size_t operationsPerRound = 20000;
+      size_t objects = 64;
+      size_t privateObjects = 8;
+      size_t slots = 32;
+      double perturbation = 0.01;
+   };
+
+   struct Payload
+   {
+      uint64_t id;
+   };
+
+   struct Node : RefCountableBase<Node>
+   {
+      explicit Node(uint64_t id) : RefCountableBase<Node>{*this}, id{id} {}
+
+      uint64_t id;
+   };
+
+   class Random
+   {
+   public:
+      explicit Random(uint64_t seed) : state{seed} {}
+
+      uint64_t next()
+      {
+         uint64_t z = state += 0x9e3779b97f4a7c15ull;
+         z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+         z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+         return z ^ (z >> 31);
+      }
+
+      size_t below(size_t bound)
+      {
+         return static_cast<size_t>(next() % bound);
+      }
+
+      bool chance(double probability)
+      {
+         return static_cast<double>(next() >> 11) * 0x1.0p-53 < probability;
+      }
+
+   private:
+      uint64_t state;
+   };
+
+   // Text printed when a run fails, prepared before the run starts so that
+   // the abort handler only has to write it.
+   char replay[256];
+
+   void onAbort(int)
+   {
+#if defined(__unix__) || defined(__APPLE__)
+      const ssize_t written = write(STDERR_FILENO, replay, std::strlen(replay));
+      (void)written;
+#endif
+      std::signal(SIGABRT, SIG_DFL);
+      std::raise(SIGABRT);
+   }
+
+   [[noreturn]] void fail(const char *message, size_t detail)
+   {
+      std::fprintf(stderr, "check failed: %s (%zu)\n%s", message, detail, replay);
+      std::exit(1);
+   }
+
+   template <typename Handle>
+   struct Slot
+   {
+      std::optional<Handle> handle;
+      size_t object = none;
+   };
+
+   struct Mailbox
+   {
+      std::mutex lock;
+      RefCountedOpt<Payload> handle;
+      size_t object = none;
+   };
+
+   // Shared payloads come first, then privateObjects payloads per worker.
+   // Only the owner refers to its private payloads, so it may destroy and
+   // recreate them once it has dropped its own handles.
+   //
+   // Modes such as REFCOUNTABLE_RUNTIME_CHECKS and
+   // REFCOUNTABLE_SAMPLED_COUNTING leave some objects' handles uncounted.
+   // Each object is probed with one handle when it is created, and the
+   // model expects uncounted objects never to be referenced.
+   struct World
+   {
+      World(const Config &config, unsigned threads)
+          : config{config}, payloads(config.objects + config.privateObjects * threads), nodes(config.objects),
+            countedPayloads(payloads.size()), countedNodes(nodes.size()), mailboxes(config.objects)
+      {
+         for (size_t object = 0; object < payloads.size(); ++object)
+            recreatePayload(object);
+         for (size_t object = 0; object < nodes.size(); ++object)
+            recreateNode(object);
+      }
+
+      void recreatePayload(size_t object)
+      {
+         payloads[object].reset();
+         payloads[object] = std::make_unique<RefCountable<Payload>>(Payload{nextId.fetch_add(1, std::memory_order_relaxed)});
+         countedPayloads[object] = counts(*payloads[object]);
+      }
+
+      void recreateNode(size_t object)
+      {
+         nodes[object].reset();
+         nodes[object] = std::make_unique<Node>(nextId.fetch_add(1, std::memory_order_relaxed));
+         countedNodes[object] = counts(*nodes[object]);
+      }
+
+      static bool counts(RefCountable<Payload> &payload)
+      {
+         RefCounted<Payload> probe{payload};
+         return payload.isReferenced();
+      }
+
+      static bool counts(Node &node)
+      {
+         RefCounted<Node> probe{node};
+         return node.isReferenced();
+      }
+
+      size_t privateObject(unsigned thread, size_t index) const
+      {
+         return config.objects + thread * config.privateObjects + index;
+      }
+
+      const Config &config;
+      std::vector<std::unique_ptr<RefCountable<Payload>>> payloads;
+      std::vector<std::unique_ptr<Node>> nodes;
+      // One char per object, since private payloads are recreated
+      // concurrently by their owners.
+      std::vector<char> countedPayloads;
+      std::vector<char> countedNodes;
+      std::vector<Mailbox> mailboxes;
+      std::atomic<uint64_t> nextId{1};
+   };
+
+   class Worker
+   {
+   public:
+      Worker(World &world, unsigned thread, uint64_t seed)
+          : world{world}, thread{thread}, random{seed ^ (0xd1b54a32d192ed03ull * (thread + 1))},
+            counted(world.config.slots), optional(world.config.slots), any(world.config.slots),
+            nodes(world.config.slots)
+      {
+      }
+
+      void runRound()
+      {
+         for (size_t i = 0; i < world.config.operationsPerRound; ++i)
+         {
+            step();
+
+            if (random.chance(world.config.perturbation))
+               perturb();
+         }
+      }
+
+      void clear()
+      {
+         for (auto &slot : counted)
+            release(slot);
+         for (auto &slot : optional)
+            release(slot);
+         for (auto &slot : any)
+            release(slot);
+         for (auto &slot : nodes)
+            release(slot);
+      }
+
+      // Adds the number of handles this worker holds per object.
+      void countReferences(std::vector<size_t> &payloads, std::vector<size_t> &nodeReferences) const
+      {
+         auto count = [](const auto &slots, std::vector<size_t> &references)
+         {
+            for (const auto &slot : slots)
+               if (slot.object != none)
+                  ++references[slot.object];
+         };
+
+         count(counted, payloads);
+         count(optional, payloads);
+         count(any, payloads);
+         count(nodes, nodeReferences);
+      }
+
+   private:
+      void step()
+      {
+         switch (random.below(12))
+         {
+         case 0:
+         case 1:
+            acquire();
+            break;
+         case 2:
+         case 3:
+            copy();
+            break;
+         case 4:
+            assign();
+            break;
+         case 5:
+            move();
+            break;
+         case 6:
+         case 7:
+            releaseOne();
+            break;
+         case 8:
+            send();
+            break;
+         case 9:
+            receive();
+            break;
+         case 10:
+            recreatePrivate();
+            break;
+         case 11:
+            acquireNode();
+            break;
+         }
+      }
+
+      size_t pickPayload()
+      {
+         if (world.config.privateObjects != 0 && random.chance(0.25))
+            return world.privateObject(thread, random.below(world.config.privateObjects));
+         return random.below(world.config.objects);
+      }
+
+      void acquire()
+      {
+         const size_t object = pickPayload();
+         RefCountable<Payload> &target = *world.payloads[object];
+
+         switch (random.below(3))
+         {
+         case 0:
+         {
+            auto &slot = counted[random.below(counted.size())];
+            slot.handle.reset();
+            slot.handle.emplace(target);
+            slot.object = object;
+            verify(slot);
+            break;
+         }
+         case 1:
+         {
+            auto &slot = optional[random.below(optional.size())];
+            slot.handle = RefCountedOpt<Payload>{target};
+            slot.object = object;
+            verify(slot);
+            break;
+         }
+         case 2:
+         {
+            auto &slot = any[random.below(any.size())];
+            slot.handle.reset();
+            slot.handle.emplace(target);
+            slot.object = object;
+            verify(slot);
+            break;
+         }
+         }
+      }
+
+      void acquireNode()
+      {
+         const size_t object = random.below(world.nodes.size());
+         auto &slot = nodes[random.below(nodes.size())];
+         slot.handle.reset();
+         slot.handle.emplace(*world.nodes[object]);
+         slot.object = object;
+         verify(slot);
+      }
+
+      void copy()
+      {
+         auto &from = counted[random.below(counted.size())];
+         if (from.object == none)
+            return;
+
+         switch (random.below(3))
+         {
+         case 0:
+         {
+            auto &to = counted[random.below(counted.size())];
+            if (&to == &from)
+               return;
+            to.handle.reset();
+            to.handle.emplace(*from.handle);
+            to.object = from.object;
+            verify(to);
+            break;
+         }
+         case 1:
+         {
+            auto &to = optional[random.below(optional.size())];
+            to.handle = RefCountedOpt<Payload>{*from.handle};
+            to.object = from.object;
+            verify(to);
+            break;
+         }
+         case 2:
+         {
+            auto &to = any[random.below(any.size())];
+            to.handle.reset();
+            to.handle.emplace(*from.handle);
+            to.object = from.object;
+            verify(to);
+            break;
+         }
+         }
+      }
+
+      void assign()
+      {
+         switch (random.below(3))
+         {
+         case 0:
+            assignBetween(counted);
+            break;
+         case 1:
+            assignBetween(any);
+            break;
+         case 2:
+            assignBetween(nodes);
+            break;
+         }
+      }
+
+      template <typename Handle>
+      void assignBetween(std::vector<Slot<Handle>> &slots)
+      {
+         auto &from = slots[random.below(slots.size())];
+         auto &to = slots[random.below(slots.size())];
+         if (from.object == none || to.object == none)
+            return;
+
+         *to.handle = *from.handle;
+         to.object = from.object;
+         verify(to);
+      }
+
+      void move()
+      {
+         if (random.below(2) == 0)
+         {
+            auto &from = optional[random.below(optional.size())];
+            auto &to = optional[random.below(optional.size())];
+            if (&from == &to)
+               return;
+
+            to.handle = std::move(from.handle);
+            to.object = from.object;
+            from.object = none;
+
+            if (from.handle && *from.handle)
+               fail("moved-from RefCountedOpt is not empty", thread);
+            if (to.object != none)
+               verify(to);
+            return;
+         }
+
+         // Moves the RefAny itself rather than the optional around it.
+         auto &from = any[random.below(any.size())];
+         auto &to = any[random.below(any.size())];
+         if (&from == &to || from.object == none)
+            return;
+
+         if (to.object == none)
+            to.handle.emplace(std::move(*from.handle));
+         else
+            *to.handle = std::move(*from.handle);
+         to.object = from.object;
+
+         if (from.handle->holds<Payload>())
+            fail("moved-from RefAny still holds its object", thread);
+         release(from);
+         verify(to);
+      }
+
+      void releaseOne()
+      {
+         switch (random.below(4))
+         {
+         case 0:
+            release(counted[random.below(counted.size())]);
+            break;
+         case 1:
+            release(optional[random.below(optional.size())]);
+            break;
+         case 2:
+            release(any[random.below(any.size())]);
+            break;
+         case 3:
+            release(nodes[random.below(nodes.size())]);
+            break;
+         }
+      }
+
+      template <typename Handle>
+      static void release(Slot<Handle> &slot)
+      {
+         slot.handle.reset();
+         slot.object = none;
+      }
+
+      // Hands a handle to a shared payload to whichever worker receives
+      // from the same mailbox, so that it is released on another thread.
+      void send()
+      {
+         auto &from = optional[random.below(optional.size())];
+         if (from.object == none || from.object >= world.config.objects)
+            return;
+
+         Mailbox &mailbox = world.mailboxes[random.below(world.mailboxes.size())];
+         std::lock_guard<std::mutex> guard{mailbox.lock};
+         mailbox.handle = std::move(*from.handle);
+         mailbox.object = from.object;
+         release(from);
+      }
+
+      void receive()
+      {
+         auto &to = optional[random.below(optional.size())];
+         Mailbox &mailbox = world.mailboxes[random.below(world.mailboxes.size())];
+
+         std::lock_guard<std::mutex> guard{mailbox.lock};
+         if (mailbox.object == none)
+            return;
+
+         to.handle = std::move(mailbox.handle);
+         to.object = mailbox.object;
+         mailbox.object = none;
+         verify(to);
+      }
+
+      void recreatePrivate()
+      {
+         if (world.config.privateObjects == 0)
+            return;
+
+         const size_t object = world.privateObject(thread, random.below(world.config.privateObjects));
+         auto drop = [object](auto &slots)
+         {
+            for (auto &slot : slots)
+               if (slot.object == object)
+                  release(slot);
+         };
+
+         drop(counted);
+         drop(optional);
+         drop(any);
+
+         if (!world.payloads[object]->drainFor(std::chrono::seconds{0}))
+            fail("private object still referenced after its owner released it", object);
+
+         world.recreatePayload(object);
+      }
+
+      void perturb()
+      {
+         if (random.chance(0.5))
+         {
+            std::this_thread::yield();
+            return;
+         }
+
+         const size_t spins = random.below(2000);
+         for (volatile size_t i = 0; i < spins; ++i)
+         {
+         }
+      }
+
+      void verify(const Slot<RefCounted<Payload>> &slot) const
+      {
+         if (&slot.handle->get() != &world.payloads[slot.object]->get())
+            fail("RefCounted refers to the wrong object", slot.object);
+      }
+
+      void verify(const Slot<RefCountedOpt<Payload>> &slot) const
+      {
+         if (!*slot.handle || &slot.handle->get() != &world.payloads[slot.object]->get())
+            fail("RefCountedOpt refers to the wrong object", slot.object);
+      }
+
+      void verify(const Slot<RefAny> &slot) const
+      {
+         if (slot.handle->getIf<Node>() || slot.handle->getIf<Payload>() != &world.payloads[slot.object]->get())
+            fail("RefAny refers to the wrong object", slot.object);
+      }
+
+      void verify(const Slot<RefCounted<Node>> &slot) const
+      {
+         if (&slot.handle->get() != world.nodes[slot.object].get() || slot.handle->get().id != world.nodes[slot.object]->id)
+            fail("RefCounted<Node> refers to the wrong object", slot.object);
+      }
+
+      World &world;
+      const unsigned thread;
+      Random random;
+      std::vector<Slot<RefCounted<Payload>>> counted;
+      std::vector<Slot<RefCountedOpt<Payload>>> optional;
+      std::vector<Slot<RefAny>> any;
+      std::vector<Slot<RefCounted<Node>>> nodes;
+   };
+
+   // Between rounds every worker is parked, so the references the model
+   // expects must match which objects drain immediately.
+   void checkReferences(World &world, const std::vector<std::unique_ptr<Worker>> &workers, bool cleared)
+   {
+      std::vector<size_t> payloads(world.payloads.size());
+      std::vector<size_t> nodes(world.nodes.size());
+
+      for (const auto &worker : workers)
+         worker->countReferences(payloads, nodes);
+      for (Mailbox &mailbox : world.mailboxes)
+         if (mailbox.object != none)
+            ++payloads[mailbox.object];
+
+      for (size_t object = 0; object < payloads.size(); ++object)
+      {
+         const bool referenced = world.countedPayloads[object] && payloads[object] != 0;
+         if (referenced == world.payloads[object]->drainFor(std::chrono::seconds{0}))
+            fail(cleared ? "payload still referenced after every handle was released"
+                         : "payload reference count does not match the handles held",
+                 object);
+      }
+
+      for (size_t object = 0; object < nodes.size(); ++object)
+      {
+         const bool referenced = world.countedNodes[object] && nodes[object] != 0;
+         if (referenced == world.nodes[object]->drainFor(std::chrono::seconds{0}))
+            fail(cleared ? "node still referenced after every handle was released"
+                         : "node reference count does not match the handles held",
+                 object);
+      }
+   }
+
+   struct Result
+   {
+      uint64_t seed;
+      unsigned threads;
+      size_t operations;
+      double seconds;
+   };
+
+   Result run(const Config &config, uint64_t seed, unsigned threads)
+   {
+      std::snprintf(replay, sizeof(replay),
+                    "replay with: --seed=%llu --runs=1 --threads=%u --rounds=%zu --ops=%zu --objects=%zu "
+                    "--private=%zu --slots=%zu --perturb=%g\n",
+                    static_cast<unsigned long long>(seed), threads, config.rounds, config.operationsPerRound,
+                    config.objects, config.privateObjects, config.slots, config.perturbation);
+
+      World world{config, threads};
+      std::vector<std::unique_ptr<Worker>> workers;
+      for (unsigned thread = 0; thread < threads; ++thread)
+         workers.push_back(std::make_unique<Worker>(world, thread, seed));
+
+      Barrier barrier{threads + 1};
+      std::vector<std::thread> pool;
+      for (unsigned thread = 0; thread < threads; ++thread)
+      {
+         pool.emplace_back([&, thread]
+                           {
+            thread_local std::optional<RefCounted<int>> threadExitHandle;
+            threadExitHandle.emplace(exitObject);
+
+            for (size_t round = 0; round < config.rounds; ++round)
+            {
+               barrier.wait();
+               workers[thread]->runRound();
+               barrier.wait();
+               barrier.wait();
+               workers[thread]->clear();
+               barrier.wait();
+            } });
+      }
+
+      Random random{seed};
+      std::chrono::steady_clock::duration elapsed{};
+      for (size_t round = 0; round < config.rounds; ++round)
+      {
+         barrier.wait();
+         const auto started = std::chrono::steady_clock::now();
+         barrier.wait();
+         elapsed += std::chrono::steady_clock::now() - started;
+
+         checkReferences(world, workers, false);
+         for (Mailbox &mailbox : world.mailboxes)
+         {
+            mailbox.handle.reset();
+            mailbox.object = none;
+         }
+
+         barrier.wait();
+         barrier.wait();
+         checkReferences(world, workers, true);
+
+         // Every handle is gone, so destroying shared objects must succeed.
+         for (size_t i = 0; i < std::max<size_t>(1, config.objects / 8); ++i)
+         {
+            world.recreatePayload(random.below(config.objects));
+            world.recreateNode(random.below(config.objects));
+         }
+      }
+
+      for (std::thread &thread : pool)
+         thread.join();
+
+      return Result{seed, threads, config.operationsPerRound * config.rounds * threads,
+                    std::chrono::duration<double>(elapsed).count()};
+   }
+
+   const char *const usageOptions = "[--threads=2,4] [--seed=N] [--runs=N] [--rounds=N] [--ops=N]\n"
+                                    "          [--objects=N] [--private=N] [--slots=N] [--perturb=P]\n";
+
+   Config parseArguments(int argc, char **argv)
+   {
+      Config config;
+
+      for (int i = 1; i < argc; ++i)
+      {
+         const char *argument = argv[i];
+         auto option = [&](const char *prefix) -> const char *
+         {
+            const size_t length = std::strlen(prefix);
+            return std::strncmp(argument, prefix, length) == 0 ? argument + length : nullptr;
+         };
+
+         if (const char *value = option("--threads="))
+         {
+            config.threads = parseList<unsigned>(value, [](const std::string &item)
+                                                 { return std::max(1u, static_cast<unsigned>(std::stoul(item))); });
+         }
+         else if (const char *value = option("--seed="))
+            config.seed = std::stoull(value);
+         else if (const char *value = option("--runs="))
+            config.runs = std::stoull(value);
+         else if (const char *value = option("--rounds="))
+            config.rounds = std::stoull(value);
+         else if (const char *value = option("--ops="))
+            config.operationsPerRound = std::stoull(value);
+         else if (const char *value = option("--objects="))
+            config.objects = std::max<size_t>(1, std::stoull(value));
+         else if (const char *value = option("--private="))
+            config.privateObjects = std::stoull(value);
+         else if (const char *value = option("--slots="))
+            config.slots = std::max<size_t>(1, std::stoull(value));
+         else if (const char *value = option("--perturb="))
+            config.perturbation = std::stod(value);
+         else
+            usage(argv[0], usageOptions);
+      }
+
+      if (config.threads.empty())
+         config.threads = {2, std::max(2u, std::thread::hardware_concurrency())};
+
+      return config;
+   }
+
+   // Regression checks for RefCounted's own copy constructor and copy
+   // assignment, which the implicitly generated versions once bypassed
+   // without counting. Skipped in modes that leave new handles uncounted.
+   void checkHandleCopies()
+   {
+      RefCountable<int> first{1};
+      RefCountable<int> second{2};
+
+      std::optional<RefCounted<int>> original{std::in_place, first};
+      if (!first.isReferenced())
+         return;
+
+      std::optional<RefCounted<int>> copy{std::in_place, std::as_const(*original)};
+      original.reset();
+      if (!first.isReferenced())
+         fail("copy-constructed RefCounted is not counted", 0);
+
+      std::optional<RefCounted<int>> assigned{std::in_place, second};
+      *assigned = std::as_const(*copy);
+      if (second.isReferenced())
+         fail("copy assignment did not release the previous object", 0);
+
+      copy.reset();
+      if (!first.isReferenced())
+         fail("copy-assigned RefCounted is not counted", 0);
+
+      assigned.reset();
+      if (first.isReferenced())
+         fail("object still referenced after its copied handles were released", 0);
+
+#if defined(__unix__) || defined(__APPLE__)
+      // Destroying the object while only a copy refers to it must still
+      // trip the destructor check.
+      const pid_t child = fork();
+      if (child == 0)
+      {
+         std::freopen("/dev/null", "w", stderr);
+         std::signal(SIGABRT, SIG_DFL);
+
+         auto *object = new RefCountable<int>{3};
+         std::optional<RefCounted<int>> handle{std::in_place, *object};
+         new RefCounted<int>{std::as_const(*handle)};
+         handle.reset();
+         delete object;
+         _exit(0);
+      }
+
+      int status = 0;
+      if (child < 0 || waitpid(child, &status, 0) != child || !WIFSIGNALED(status) || WTERMSIG(status) != SIGABRT)
+         fail("destroying an object referenced only by a copy did not terminate", 0);
+#endif
+   }
+}
+
+int main(int argc, char **argv)
+{
+   const Config config = parseArguments(argc, argv);
+   checkHandleCopies();
+   std::signal(SIGABRT, onAbort);
+
+   std::printf("seed,threads,operations,seconds,mops_per_second\n");
+   for (size_t i = 0; i < config.runs; ++i)
+   {
+      for (unsigned threads : config.threads)
+      {
+         const Result result = run(config, config.seed + i, threads);
+         std::printf("%llu,%u,%zu,%.6f,%.3f\n", static_cast<unsigned long long>(result.seed), result.threads,
+                     result.operations, result.seconds, result.operations / result.seconds / 1e6);
+         std::fflush(stdout);
+      }
+   }
+}
@@ -0,0 +1,474 @@
+// Replays a capture written by RefCountableRecorder against several
+// counter policies, to estimate what a different counting strategy would
+// buy on real traffic before switching to it.
+//
+//    g++ -std=c++17 -O2 -pthread -I.. TraceReplay.cpp -o TraceReplay
+//    ./TraceReplay capture.rcrec --threads=4,8 --policies=atomic,biased,sharded --perf
+//
+// Recorded threads are mapped onto replay threads round-robin, and each
+// replay thread applies its events in recorded order as fast as it can;
+// events of different threads are not re-synchronised. Every object gets
+// a slot of --stride bytes in id order, which keeps the neighbourhood of
+// the original addresses. Policies:
+//
+//    atomic     relaxed fetch_add/fetch_sub on one counter, as RefCounted does
+//    nonatomic  relaxed load and store, the cost of an unshared counter
+//    biased     the first thread to touch an object updates a private count,
+//               every other thread the shared atomic count
+//    sharded    one cache-line-padded atomic count per shard, chosen by thread
+
+#include "RefCountableRecorder.hpp"
+#include "PerfCounters.hpp"
+#include "BenchCommon.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <new>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+   using Event = RefCountableRecorder::Event;
+   using Record = RefCountableRecorder::Record;
+
+   enum class Policy
+   {
+      Atomic,
+      NonAtomic,
+      Biased,
+      Sharded
+   };
+
+   enum class Format
+   {
+      Csv,
+      Json
+   };
+
+   const char *name(Policy policy)
+   {
+      switch (policy)
+      {
+      case Policy::Atomic:
+         return "atomic";
+      case Policy::NonAtomic:
+         return "nonatomic";
+      case Policy::Biased:
+         return "biased";
+      case Policy::Sharded:
+         return "sharded";
+      }
+      return "";
+   }
+
+   struct Config
+   {
+      const char *path = nullptr;
+      std::vector<unsigned> threads;
+      std::vector<Policy> policies{Policy::Atomic, Policy::NonAtomic, Policy::Biased, Policy::Sharded};
+      size_t repeat = 1;
+      size_t stride = 16;
+      size_t shards = 8;
+      bool perf = false;
+      std::vector<PerfEvent> events;
+      Format format = Format::Csv;
+   };
+
+   struct Result
+   {
+      Policy policy;
+      unsigned threads;
+      size_t events;
+      double seconds;
+      std::vector<double> eventsPerOperation;
+   };
+
+   // Raw storage for one policy's counters, one slot per object.
+   class Slots
+   {
+   public:
+      Slots(size_t objects, size_t stride)
+          : stride{stride}, bytes{static_cast<char *>(::operator new(objects * stride, std::align_val_t{64}))}
+      {
+         std::memset(bytes, 0, objects * stride);
+      }
+
+      ~Slots()
+      {
+         ::operator delete(bytes, std::align_val_t{64});
+      }
+
+      Slots(const Slots &) = delete;
+      Slots &operator=(const Slots &) = delete;
+
+      template <typename T>
+      T &at(size_t object)
+      {
+         return *std::launder(reinterpret_cast<T *>(bytes + object * stride));
+      }
+
+   private:
+      const size_t stride;
+      char *bytes;
+   };
+
+   struct AtomicPolicy
+   {
+      AtomicPolicy(size_t objects, const Config &config) : slots{objects, std::max(config.stride, sizeof(std::atomic<size_t>))} {}
+
+      void acquire(uint32_t object, unsigned) { slots.at<std::atomic<size_t>>(object).fetch_add(1, std::memory_order_relaxed); }
+      void release(uint32_t object, unsigned) { slots.at<std::atomic<size_t>>(object).fetch_sub(1, std::memory_order_release); }
+      size_t destroy(uint32_t object) { return slots.at<std::atomic<size_t>>(object).load(std::memory_order_acquire); }
+
+      Slots slots;
+   };
+
+   struct NonAtomicPolicy
+   {
+      NonAtomicPolicy(size_t objects, const Config &config) : slots{objects, std::max(config.stride, sizeof(std::atomic<size_t>))} {}
+
+      void acquire(uint32_t object, unsigned) { update(object, 1); }
+      void release(uint32_t object, unsigned) { update(object, -1); }
+      size_t destroy(uint32_t object) { return slots.at<std::atomic<size_t>>(object).load(std::memory_order_relaxed); }
+
+      void update(uint32_t object, size_t delta)
+      {
+         std::atomic<size_t> &counter = slots.at<std::atomic<size_t>>(object);
+         counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+      }
+
+      Slots slots;
+   };
+
+   struct BiasedCounter
+   {
+      std::atomic<uint32_t> owner;
+      std::atomic<size_t> local;
+      std::atomic<size_t> shared;
+   };
+
+   struct BiasedPolicy
+   {
+      BiasedPolicy(size_t objects, const Config &config) : slots{objects, std::max(config.stride, sizeof(BiasedCounter))} {}
+
+      void acquire(uint32_t object, unsigned thread) { update(object, thread, 1); }
+      void release(uint32_t object, unsigned thread) { update(object, thread, -1); }
+
+      size_t destroy(uint32_t object)
+      {
+         BiasedCounter &counter = slots.at<BiasedCounter>(object);
+         return counter.local.load(std::memory_order_acquire) + counter.shared.load(std::memory_order_acquire);
+      }
+
+      // Owner ids are thread + 1, so that zero means unowned.
+      void update(uint32_t object, unsigned thread, size_t delta)
+      {
+         BiasedCounter &counter = slots.at<BiasedCounter>(object);
+
+         uint32_t owner = counter.owner.load(std::memory_order_relaxed);
+         if (owner == 0 && counter.owner.compare_exchange_strong(owner, thread + 1, std::memory_order_relaxed))
+            owner = thread + 1;
+
+         if (owner == thread + 1)
+            counter.local.store(counter.local.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+         else
+            counter.shared.fetch_add(delta, std::memory_order_relaxed);
+      }
+
+      Slots slots;
+   };
+
+   struct alignas(64) Shard
+   {
+      std::atomic<size_t> count;
+   };
+
+   struct ShardedPolicy
+   {
+      ShardedPolicy(size_t objects, const Config &config)
+          : shards{config.shards}, slots{objects, config.shards * sizeof(Shard)}
+      {
+      }
+
+      void acquire(uint32_t object, unsigned thread) { shard(object, thread).fetch_add(1, std::memory_order_relaxed); }
+      void release(uint32_t object, unsigned thread) { shard(object, thread).fetch_sub(1, std::memory_order_release); }
+
+      size_t destroy(uint32_t object)
+      {
+         size_t total = 0;
+         for (size_t i = 0; i < shards; ++i)
+            total += shard(object, static_cast<unsigned>(i)).load(std::memory_order_acquire);
+         return total;
+      }
+
+      std::atomic<size_t> &shard(uint32_t object, unsigned thread)
+      {
+         return (&slots.at<Shard>(object))[thread % shards].count;
+      }
+
+      const size_t shards;
+      Slots slots;
+   };
+
+   using Clock = std::chrono::steady_clock;
+
+   template <typename Counters>
+   Result replay(const Config &config, Policy policy, const RefCountableRecorder::Header &header,
+                 const std::vector<std::vector<Record>> &streams)
+   {
+      Counters counters{header.objects, config};
+      const unsigned threads = static_cast<unsigned>(streams.size());
+
+      Barrier barrier{threads};
+      std::vector<double> seconds(threads);
+      std::vector<std::vector<int64_t>> events(threads);
+      std::vector<size_t> sink(threads);
+
+      std::vector<std::thread> pool;
+      for (unsigned thread = 0; thread < threads; ++thread)
+      {
+         pool.emplace_back([&, thread]
+                           {
+            std::optional<PerfCounterGroup> perf;
+            if (config.perf)
+               perf.emplace(config.events);
+
+            barrier.wait();
+            if (perf)
+               perf->enable();
+            const Clock::time_point started = Clock::now();
+
+            size_t destroyed = 0;
+            for (size_t round = 0; round < config.repeat; ++round)
+            {
+               for (const Record &record : streams[thread])
+               {
+                  switch (record.event)
+                  {
+                  case Event::Acquire:
+                     counters.acquire(record.object, thread);
+                     break;
+                  case Event::Release:
+                     counters.release(record.object, thread);
+                     break;
+                  case Event::Destroy:
+                     destroyed += counters.destroy(record.object);
+                     break;
+                  case Event::Construct:
+                     break;
+                  }
+               }
+            }
+
+            seconds[thread] = std::chrono::duration<double>(Clock::now() - started).count();
+            if (perf)
+            {
+               perf->disable();
+               events[thread] = perf->read();
+            }
+            sink[thread] = destroyed; });
+      }
+
+      for (std::thread &thread : pool)
+         thread.join();
+
+      Result result{policy, threads, 0, *std::max_element(seconds.begin(), seconds.end()), {}};
+      for (const std::vector<Record> &stream : streams)
+         result.events += stream.size() * config.repeat;
+
+      for (size_t event = 0; event < config.events.size(); ++event)
+      {
+         int64_t total = 0;
+         for (const std::vector<int64_t> &values : events)
+         {
+            if (values[event] < 0)
+            {
+               total = -1;
+               break;
+            }
+            total += values[event];
+         }
+         result.eventsPerOperation.push_back(total < 0 ? -1.0 : static_cast<double>(total) / result.events);
+      }
+
+      return result;
+   }
+
+   Result run(const Config &config, Policy policy, const RefCountableRecorder::Header &header,
+              const std::vector<Record> &records, unsigned threads)
+   {
+      std::vector<std::vector<Record>> streams(threads);
+      for (const Record &record : records)
+         streams[record.thread % threads].push_back(record);
+
+      switch (policy)
+      {
+      case Policy::Atomic:
+         return replay<AtomicPolicy>(config, policy, header, streams);
+      case Policy::NonAtomic:
+         return replay<NonAtomicPolicy>(config, policy, header, streams);
+      case Policy::Biased:
+         return replay<BiasedPolicy>(config, policy, header, streams);
+      case Policy::Sharded:
+         return replay<ShardedPolicy>(config, policy, header, streams);
+      }
+      return {};
+   }
+
+   // Deltas are relative to the atomic policy at the same thread count,
+   // which is what RefCounted does today.
+   void print(const std::vector<Result> &results, const Config &config)
+   {
+      auto baseline = [&](const Result &result) -> const Result *
+      {
+         for (const Result &candidate : results)
+            if (candidate.policy == Policy::Atomic && candidate.threads == result.threads)
+               return &candidate;
+         return nullptr;
+      };
+
+      auto speedup = [&](const Result &result)
+      {
+         const Result *atomic = baseline(result);
+         return atomic ? atomic->seconds / result.seconds : 0.0;
+      };
+
+      auto delta = [&](const Result &result, size_t event)
+      {
+         const Result *atomic = baseline(result);
+         if (!atomic || result.eventsPerOperation[event] < 0 || atomic->eventsPerOperation[event] < 0)
+            return 0.0;
+         return result.eventsPerOperation[event] - atomic->eventsPerOperation[event];
+      };
+
+      if (config.format == Format::Csv)
+      {
+         std::printf("policy,threads,events,seconds,mevents_per_second,speedup_vs_atomic");
+         for (const PerfEvent &event : config.events)
+            std::printf(",%s_per_event,%s_delta_vs_atomic", event.name, event.name);
+         std::printf("\n");
+
+         for (const Result &result : results)
+         {
+            std::printf("%s,%u,%zu,%.6f,%.3f,%.3f", name(result.policy), result.threads, result.events,
+                        result.seconds, result.events / result.seconds / 1e6, speedup(result));
+            for (size_t event = 0; event < config.events.size(); ++event)
+               std::printf(",%.4f,%.4f", result.eventsPerOperation[event], delta(result, event));
+            std::printf("\n");
+         }
+         return;
+      }
+
+      std::printf("[\n");
+      for (size_t i = 0; i < results.size(); ++i)
+      {
+         const Result &result = results[i];
+         std::printf("  {\"policy\": \"%s\", \"threads\": %u, \"events\": %zu, \"seconds\": %.6f, "
+                     "\"mevents_per_second\": %.3f, \"speedup_vs_atomic\": %.3f",
+                     name(result.policy), result.threads, result.events, result.seconds,
+                     result.events / result.seconds / 1e6, speedup(result));
+         for (size_t event = 0; event < config.events.size(); ++event)
+         {
+            std::printf(", \"%s_per_event\": %.4f, \"%s_delta_vs_atomic\": %.4f", config.events[event].name,
+                        result.eventsPerOperation[event], config.events[event].name, delta(result, event));
+         }
+         std::printf("}%s\n", i + 1 == results.size() ? "" : ",");
+      }
+      std::printf("]\n");
+   }
+
+   const char *const usageOptions = "CAPTURE [--threads=1,2,4] [--repeat=N] [--stride=BYTES] [--shards=N]\n"
+                                    "          [--policies=atomic,nonatomic,biased,sharded] [--perf] [--format=csv|json]\n";
+
+   Config parseArguments(int argc, char **argv)
+   {
+      Config config;
+
+      for (int i = 1; i < argc; ++i)
+      {
+         const char *argument = argv[i];
+         auto option = [&](const char *prefix) -> const char *
+         {
+            const size_t length = std::strlen(prefix);
+            return std::strncmp(argument, prefix, length) == 0 ? argument + length : nullptr;
+         };
+
+         if (const char *value = option("--threads="))
+         {
+            config.threads = parseList<unsigned>(value, [](const std::string &item)
+                                                 { return std::max(1u, static_cast<unsigned>(std::stoul(item))); });
+         }
+         else if (const char *value = option("--repeat="))
+            config.repeat = std::max<size_t>(1, std::stoull(value));
+         else if (const char *value = option("--stride="))
+            config.stride = std::max<size_t>(8, std::stoull(value) / 8 * 8);
+         else if (const char *value = option("--shards="))
+            config.shards = std::max<size_t>(1, std::stoull(value));
+         else if (std::strcmp(argument, "--perf") == 0)
+            config.perf = true;
+         else if (const char *value = option("--format="))
+         {
+            if (std::strcmp(value, "csv") == 0)
+               config.format = Format::Csv;
+            else if (std::strcmp(value, "json") == 0)
+               config.format = Format::Json;
+            else
+               usage(argv[0], usageOptions);
+         }
+         else if (const char *value = option("--policies="))
+         {
+            config.policies = parseList<Policy>(value, [&](const std::string &item)
+                                                {
+               for (Policy policy : {Policy::Atomic, Policy::NonAtomic, Policy::Biased, Policy::Sharded})
+                  if (item == name(policy))
+                     return policy;
+               usage(argv[0], usageOptions); });
+         }
+         else if (argument[0] != '-' && !config.path)
+            config.path = argument;
+         else
+            usage(argv[0], usageOptions);
+      }
+
+      if (!config.path)
+         usage(argv[0], usageOptions);
+
+      if (config.perf)
+         config.events = defaultPerfEvents(-1);
+
+      return config;
+   }
+}
+
+int main(int argc, char **argv)
+{
+   Config config = parseArguments(argc, argv);
+
+   std::ifstream in{config.path, std::ios::binary};
+   RefCountableRecorder::Header header;
+   std::vector<Record> records;
+   if (!RefCountableRecorder::read(in, header, records))
+   {
+      std::fprintf(stderr, "%s: not a RefCountableRecorder capture\n", config.path);
+      return 1;
+   }
+
+   if (config.threads.empty())
+      config.threads.push_back(std::max(1u, header.threads));
+
+   std::vector<Result> results;
+   for (unsigned threads : config.threads)
+      for (Policy policy : config.policies)
+         results.push_back(run(config, policy, header, records, threads));
+
+   print(results, config);
+}
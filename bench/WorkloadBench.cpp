@@ -0,0 +1,675 @@
+// Workload benchmarks comparing RefCountable/RefCounted against
+// std::shared_ptr, a hand-rolled intrusive pointer and raw pointers.
+//
+//    g++ -std=c++17 -O2 -pthread -I.. WorkloadBench.cpp -o WorkloadBench
+//    ./WorkloadBench --threads=8 --workloads=bfs,cache,pipeline --format=json
+
+#include "RefCountable.hpp"
+#include "PerfCounters.hpp"
+#include "BenchCommon.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <unistd.h>
+#endif
+
+namespace
+{
+   template <typename T>
+   struct IntrusiveBox
+   {
+      explicit IntrusiveBox(uint32_t id) : value{id} {}
+
+      T value;
+      std::atomic<uint32_t> count{0};
+   };
+
+   template <typename T>
+   class IntrusivePtr
+   {
+   public:
+      IntrusivePtr() = default;
+
+      explicit IntrusivePtr(IntrusiveBox<T> *box) : box{box}
+      {
+         acquire();
+      }
+
+      IntrusivePtr(const IntrusivePtr &rhs) : box{rhs.box}
+      {
+         acquire();
+      }
+
+      IntrusivePtr(IntrusivePtr &&rhs) noexcept : box{rhs.box}
+      {
+         rhs.box = nullptr;
+      }
+
+      IntrusivePtr &operator=(IntrusivePtr rhs) noexcept
+      {
+         std::swap(box, rhs.box);
+         return *this;
+      }
+
+      ~IntrusivePtr()
+      {
+         if (box && box->count.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete box;
+      }
+
+      T &operator*() const { return box->value; }
+
+   private:
+      void acquire()
+      {
+         if (box)
+            box->count.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      IntrusiveBox<T> *box = nullptr;
+   };
+
+   struct RefCountablePointers
+   {
+      static constexpr const char *name = "refcountable";
+
+      template <typename T>
+      using Handle = RefCounted<T>;
+
+      template <typename T>
+      class Store
+      {
+      public:
+         void emplace(uint32_t id) { items.emplace_back(id); }
+         Handle<T> handle(size_t index) { return Handle<T>{items[index]}; }
+         T &operator[](size_t index) { return items[index].get(); }
+         size_t size() const { return items.size(); }
+
+      private:
+         std::deque<RefCountable<T>> items;
+      };
+
+      template <typename T>
+      static T &get(Handle<T> &handle) { return handle.get(); }
+   };
+
+   struct SharedPtrPointers
+   {
+      static constexpr const char *name = "shared_ptr";
+
+      template <typename T>
+      using Handle = std::shared_ptr<T>;
+
+      template <typename T>
+      class Store
+      {
+      public:
+         void emplace(uint32_t id) { items.push_back(std::make_shared<T>(id)); }
+         Handle<T> handle(size_t index) { return items[index]; }
+         T &operator[](size_t index) { return *items[index]; }
+         size_t size() const { return items.size(); }
+
+      private:
+         std::vector<std::shared_ptr<T>> items;
+      };
+
+      template <typename T>
+      static T &get(Handle<T> &handle) { return *handle; }
+   };
+
+   struct IntrusivePointers
+   {
+      static constexpr const char *name = "intrusive";
+
+      template <typename T>
+      using Handle = IntrusivePtr<T>;
+
+      template <typename T>
+      class Store
+      {
+      public:
+         void emplace(uint32_t id) { items.emplace_back(new IntrusiveBox<T>{id}); }
+         Handle<T> handle(size_t index) { return items[index]; }
+         T &operator[](size_t index) { return *items[index]; }
+         size_t size() const { return items.size(); }
+
+      private:
+         std::vector<IntrusivePtr<T>> items;
+      };
+
+      template <typename T>
+      static T &get(Handle<T> &handle) { return *handle; }
+   };
+
+   struct RawPointers
+   {
+      static constexpr const char *name = "raw";
+
+      template <typename T>
+      using Handle = T *;
+
+      template <typename T>
+      class Store
+      {
+      public:
+         void emplace(uint32_t id) { items.push_back(std::make_unique<T>(id)); }
+         Handle<T> handle(size_t index) { return items[index].get(); }
+         T &operator[](size_t index) { return *items[index]; }
+         size_t size() const { return items.size(); }
+
+      private:
+         std::vector<std::unique_ptr<T>> items;
+      };
+
+      template <typename T>
+      static T &get(Handle<T> &handle) { return *handle; }
+   };
+
+   enum class Format
+   {
+      Csv,
+      Json
+   };
+
+   struct Config
+   {
+      unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+      std::vector<std::string> workloads{"bfs", "cache", "pipeline"};
+      std::vector<std::string> pointers{"refcountable", "shared_ptr", "intrusive", "raw"};
+      size_t scale = 1 << 16;
+      Format format = Format::Csv;
+   };
+
+   struct Result
+   {
+      std::string workload;
+      const char *pointers;
+      unsigned threads;
+      uint64_t operations;
+      double seconds;
+      long rssDeltaKb;
+      int64_t cacheMisses;
+   };
+
+   using Clock = std::chrono::steady_clock;
+
+   long residentKb()
+   {
+#if defined(__linux__)
+      long size = 0;
+      long resident = 0;
+      if (FILE *statm = std::fopen("/proc/self/statm", "r"))
+      {
+         if (std::fscanf(statm, "%ld %ld", &size, &resident) != 2)
+            resident = 0;
+         std::fclose(statm);
+      }
+      return resident * (sysconf(_SC_PAGESIZE) / 1024);
+#else
+      return 0;
+#endif
+   }
+
+   // Measures the region between construction and finish(); the cache
+   // miss counter inherits into worker threads spawned in between.
+   class Measurement
+   {
+   public:
+      explicit Measurement(long rssBefore)
+          : rssBefore{rssBefore}, cacheMisses{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES}
+      {
+         cacheMisses.start();
+         begin = Clock::now();
+      }
+
+      Result finish(std::string workload, const char *pointers, unsigned threads, uint64_t operations)
+      {
+         const Clock::time_point end = Clock::now();
+         cacheMisses.stop();
+
+         return Result{std::move(workload), pointers, threads, operations,
+                       std::chrono::duration<double>(end - begin).count(),
+                       residentKb() - rssBefore, cacheMisses.read()};
+      }
+
+   private:
+      long rssBefore;
+      PerfCounter cacheMisses;
+      Clock::time_point begin;
+   };
+
+   template <typename P>
+   struct GraphNode
+   {
+      explicit GraphNode(uint32_t id) : id{id} {}
+
+      uint32_t id;
+      std::atomic<uint32_t> visited{0};
+      std::vector<typename P::template Handle<GraphNode>> edges;
+   };
+
+   template <typename P>
+   Result runBfs(const Config &config)
+   {
+      using Node = GraphNode<P>;
+      using Handle = typename P::template Handle<Node>;
+
+      constexpr size_t degree = 8;
+      constexpr uint32_t searches = 4;
+
+      const long rssBefore = residentKb();
+      const size_t nodes = config.scale;
+
+      typename P::template Store<Node> graph;
+      for (size_t i = 0; i < nodes; ++i)
+         graph.emplace(static_cast<uint32_t>(i));
+
+      std::mt19937_64 random{42};
+      for (size_t i = 0; i < nodes; ++i)
+      {
+         for (size_t edge = 0; edge < degree; ++edge)
+            graph[i].edges.push_back(graph.handle(random() % nodes));
+      }
+
+      Measurement measurement{rssBefore};
+
+      std::vector<Handle> frontier;
+      std::vector<std::vector<Handle>> next(config.threads);
+      std::atomic<size_t> cursor{0};
+      std::atomic<uint64_t> traversed{0};
+      std::atomic<bool> done{false};
+      Barrier barrier{config.threads + 1};
+
+      auto worker = [&](unsigned thread, uint32_t &generation)
+      {
+         for (;;)
+         {
+            barrier.wait();
+            if (done.load(std::memory_order_acquire))
+               return;
+
+            uint64_t edges = 0;
+            for (size_t index; (index = cursor.fetch_add(64, std::memory_order_relaxed)) < frontier.size();)
+            {
+               const size_t end = std::min(index + 64, frontier.size());
+               for (; index < end; ++index)
+               {
+                  for (Handle &edge : P::get(frontier[index]).edges)
+                  {
+                     ++edges;
+
+                     uint32_t seen = P::get(edge).visited.load(std::memory_order_relaxed);
+                     if (seen != generation &&
+                         P::get(edge).visited.compare_exchange_strong(seen, generation, std::memory_order_relaxed))
+                        next[thread].push_back(edge);
+                  }
+               }
+            }
+            traversed.fetch_add(edges, std::memory_order_relaxed);
+
+            barrier.wait();
+         }
+      };
+
+      uint32_t generation = 0;
+      std::vector<std::thread> workers;
+      for (unsigned thread = 0; thread < config.threads; ++thread)
+         workers.emplace_back(worker, thread, std::ref(generation));
+
+      for (uint32_t search = 0; search < searches; ++search)
+      {
+         generation = search + 1;
+         frontier.clear();
+         frontier.push_back(graph.handle(search));
+         P::get(frontier.back()).visited.store(generation, std::memory_order_relaxed);
+
+         while (!frontier.empty())
+         {
+            cursor.store(0, std::memory_order_relaxed);
+            barrier.wait();
+            barrier.wait();
+
+            frontier.clear();
+            for (std::vector<Handle> &items : next)
+            {
+               frontier.insert(frontier.end(), items.begin(), items.end());
+               items.clear();
+            }
+         }
+      }
+
+      done.store(true, std::memory_order_release);
+      barrier.wait();
+      for (std::thread &thread : workers)
+         thread.join();
+
+      Result result = measurement.finish("bfs", P::name, config.threads, traversed.load());
+
+      frontier.clear();
+      for (size_t i = 0; i < nodes; ++i)
+         graph[i].edges.clear();
+
+      return result;
+   }
+
+   struct CacheValue
+   {
+      explicit CacheValue(uint32_t id)
+      {
+         for (size_t i = 0; i < 8; ++i)
+            fields[i].store(id + i, std::memory_order_relaxed);
+      }
+
+      std::atomic<uint64_t> fields[8];
+   };
+
+   template <typename P>
+   Result runCache(const Config &config)
+   {
+      using Value = CacheValue;
+      using Handle = typename P::template Handle<Value>;
+
+      constexpr size_t shards = 64;
+      constexpr uint64_t operationsPerThread = 1 << 20;
+
+      struct alignas(64) Shard
+      {
+         std::shared_mutex lock;
+      };
+
+      const long rssBefore = residentKb();
+      const size_t values = config.scale;
+      const size_t slots = config.scale / 4;
+
+      typename P::template Store<Value> pool;
+      for (size_t i = 0; i < values; ++i)
+         pool.emplace(static_cast<uint32_t>(i));
+
+      std::vector<Handle> table;
+      table.reserve(slots);
+      for (size_t i = 0; i < slots; ++i)
+         table.push_back(pool.handle(i));
+
+      std::unique_ptr<Shard[]> locks{new Shard[shards]};
+
+      Measurement measurement{rssBefore};
+
+      std::atomic<uint64_t> checksum{0};
+      std::vector<std::thread> workers;
+      for (unsigned thread = 0; thread < config.threads; ++thread)
+      {
+         workers.emplace_back([&, thread]
+                              {
+            std::mt19937_64 random{thread + 1};
+            uint64_t sum = 0;
+
+            for (uint64_t i = 0; i < operationsPerThread; ++i)
+            {
+               const uint64_t bits = random();
+               const size_t slot = bits % slots;
+               Shard &shard = locks[slot % shards];
+
+               if ((bits >> 48) % 100 < 5)
+               {
+                  std::unique_lock<std::shared_mutex> guard{shard.lock};
+                  table[slot] = pool.handle((bits >> 16) % values);
+                  P::get(table[slot]).fields[0].fetch_add(1, std::memory_order_relaxed);
+                  continue;
+               }
+
+               std::optional<Handle> handle;
+               {
+                  std::shared_lock<std::shared_mutex> guard{shard.lock};
+                  handle.emplace(table[slot]);
+               }
+
+               for (const std::atomic<uint64_t> &field : P::get(*handle).fields)
+                  sum += field.load(std::memory_order_relaxed);
+            }
+
+            checksum.fetch_add(sum, std::memory_order_relaxed); });
+      }
+
+      for (std::thread &thread : workers)
+         thread.join();
+
+      Result result = measurement.finish("cache", P::name, config.threads, operationsPerThread * config.threads);
+      table.clear();
+      return result;
+   }
+
+   template <typename Handle>
+   class BoundedQueue
+   {
+   public:
+      explicit BoundedQueue(size_t capacity) : capacity{capacity} {}
+
+      void push(Handle handle)
+      {
+         std::unique_lock<std::mutex> guard{lock};
+         notFull.wait(guard, [&]
+                      { return items.size() < capacity; });
+         items.push_back(std::move(handle));
+         notEmpty.notify_one();
+      }
+
+      std::optional<Handle> pop()
+      {
+         std::unique_lock<std::mutex> guard{lock};
+         notEmpty.wait(guard, [&]
+                       { return !items.empty() || closed; });
+         if (items.empty())
+            return std::nullopt;
+
+         std::optional<Handle> handle{std::move(items.front())};
+         items.pop_front();
+         notFull.notify_one();
+         return handle;
+      }
+
+      void close()
+      {
+         std::lock_guard<std::mutex> guard{lock};
+         closed = true;
+         notEmpty.notify_all();
+      }
+
+   private:
+      std::mutex lock;
+      std::condition_variable notFull;
+      std::condition_variable notEmpty;
+      std::deque<Handle> items;
+      size_t capacity;
+      bool closed = false;
+   };
+
+   template <typename P>
+   Result runPipeline(const Config &config)
+   {
+      using Value = CacheValue;
+      using Handle = typename P::template Handle<Value>;
+
+      const long rssBefore = residentKb();
+      const size_t values = config.scale;
+      const uint64_t itemsPerProducer = 1 << 18;
+      const unsigned producers = std::max(1u, config.threads / 2);
+      const unsigned consumers = std::max(1u, config.threads - producers);
+
+      typename P::template Store<Value> pool;
+      for (size_t i = 0; i < values; ++i)
+         pool.emplace(static_cast<uint32_t>(i));
+
+      Measurement measurement{rssBefore};
+
+      BoundedQueue<Handle> queue{1024};
+      std::atomic<uint64_t> checksum{0};
+
+      std::vector<std::thread> consumerThreads;
+      for (unsigned thread = 0; thread < consumers; ++thread)
+      {
+         consumerThreads.emplace_back([&]
+                                      {
+            uint64_t sum = 0;
+            while (std::optional<Handle> handle = queue.pop())
+               sum += P::get(*handle).fields[0].load(std::memory_order_relaxed);
+            checksum.fetch_add(sum, std::memory_order_relaxed); });
+      }
+
+      std::vector<std::thread> producerThreads;
+      for (unsigned thread = 0; thread < producers; ++thread)
+      {
+         producerThreads.emplace_back([&, thread]
+                                      {
+            std::mt19937_64 random{thread + 1};
+            for (uint64_t i = 0; i < itemsPerProducer; ++i)
+               queue.push(pool.handle(random() % values)); });
+      }
+
+      for (std::thread &thread : producerThreads)
+         thread.join();
+      queue.close();
+      for (std::thread &thread : consumerThreads)
+         thread.join();
+
+      return measurement.finish("pipeline", P::name, producers + consumers, itemsPerProducer * producers);
+   }
+
+   template <typename P>
+   Result run(const Config &config, const std::string &workload)
+   {
+      if (workload == "bfs")
+         return runBfs<P>(config);
+      if (workload == "cache")
+         return runCache<P>(config);
+      return runPipeline<P>(config);
+   }
+
+   void print(const std::vector<Result> &results, Format format)
+   {
+      auto perOperation = [](const Result &result)
+      {
+         return result.cacheMisses < 0 ? -1.0 : static_cast<double>(result.cacheMisses) / result.operations;
+      };
+
+      if (format == Format::Csv)
+      {
+         std::printf("workload,pointers,threads,operations,seconds,mops_per_second,rss_delta_kb,cache_misses,cache_misses_per_op\n");
+         for (const Result &result : results)
+         {
+            std::printf("%s,%s,%u,%llu,%.6f,%.3f,%ld,%lld,%.4f\n",
+                        result.workload.c_str(), result.pointers, result.threads,
+                        static_cast<unsigned long long>(result.operations), result.seconds,
+                        result.operations / result.seconds / 1e6, result.rssDeltaKb,
+                        static_cast<long long>(result.cacheMisses), perOperation(result));
+         }
+         return;
+      }
+
+      std::printf("[\n");
+      for (size_t i = 0; i < results.size(); ++i)
+      {
+         const Result &result = results[i];
+         std::printf("  {\"workload\": \"%s\", \"pointers\": \"%s\", \"threads\": %u, \"operations\": %llu, "
+                     "\"seconds\": %.6f, \"mops_per_second\": %.3f, \"rss_delta_kb\": %ld, "
+                     "\"cache_misses\": %lld, \"cache_misses_per_op\": %.4f}%s\n",
+                     result.workload.c_str(), result.pointers, result.threads,
+                     static_cast<unsigned long long>(result.operations), result.seconds,
+                     result.operations / result.seconds / 1e6, result.rssDeltaKb,
+                     static_cast<long long>(result.cacheMisses), perOperation(result),
+                     i + 1 == results.size() ? "" : ",");
+      }
+      std::printf("]\n");
+   }
+
+   const char *const usageOptions = "[--threads=N] [--scale=N] [--workloads=bfs,cache,pipeline]\n"
+                                    "          [--pointers=refcountable,shared_ptr,intrusive,raw] [--format=csv|json]\n";
+
+   Config parseArguments(int argc, char **argv)
+   {
+      Config config;
+
+      for (int i = 1; i < argc; ++i)
+      {
+         const char *argument = argv[i];
+         auto option = [&](const char *prefix) -> const char *
+         {
+            const size_t length = std::strlen(prefix);
+            return std::strncmp(argument, prefix, length) == 0 ? argument + length : nullptr;
+         };
+
+         if (const char *value = option("--threads="))
+            config.threads = std::max(1u, static_cast<unsigned>(std::stoul(value)));
+         else if (const char *value = option("--scale="))
+            config.scale = std::max<size_t>(1024, std::stoull(value));
+         else if (const char *value = option("--workloads="))
+            config.workloads = parseList(value);
+         else if (const char *value = option("--pointers="))
+            config.pointers = parseList(value);
+         else if (const char *value = option("--format="))
+         {
+            if (std::strcmp(value, "csv") == 0)
+               config.format = Format::Csv;
+            else if (std::strcmp(value, "json") == 0)
+               config.format = Format::Json;
+            else
+               usage(argv[0], usageOptions);
+         }
+         else
+            usage(argv[0], usageOptions);
+      }
+
+      for (const std::string &workload : config.workloads)
+      {
+         if (workload != "bfs" && workload != "cache" && workload != "pipeline")
+            usage(argv[0], usageOptions);
+      }
+
+      for (const std::string &pointers : config.pointers)
+      {
+         if (pointers != RefCountablePointers::name && pointers != SharedPtrPointers::name &&
+             pointers != IntrusivePointers::name && pointers != RawPointers::name)
+            usage(argv[0], usageOptions);
+      }
+
+      return config;
+   }
+}
+
+int main(int argc, char **argv)
+{
+   const Config config = parseArguments(argc, argv);
+
+   std::vector<Result> results;
+   for (const std::string &workload : config.workloads)
+   {
+      for (const std::string &pointers : config.pointers)
+      {
+         if (pointers == RefCountablePointers::name)
+            results.push_back(run<RefCountablePointers>(config, workload));
+         else if (pointers == SharedPtrPointers::name)
+            results.push_back(run<SharedPtrPointers>(config, workload));
+         else if (pointers == IntrusivePointers::name)
+            results.push_back(run<IntrusivePointers>(config, workload));
+         else
+            results.push_back(run<RawPointers>(config, workload));
+      }
+   }
+
+   print(results, config.format);
+}